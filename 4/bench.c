@@ -0,0 +1,562 @@
+#include "thread_pool.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Benchmarks of the thread pool. Each one prints JSON lines, one per
+ * configuration, with the operation count, the throughput and the
+ * percentiles of the operation latency, so the output of two builds
+ * can be diffed or loaded into a script:
+ *
+ * {"bench":"latency","workers":4,"producers":1,"ops":20000,
+ *  "ops_per_sec":..., "p50_ns":..., "p99_ns":..., "p999_ns":...}
+ *
+ * The benchmarks to run can be given by name in the command line, all
+ * of them are run by default. The inputs are fixed, so the runs are
+ * repeatable up to the machine noise.
+ *
+ * latency - an empty task pushed and joined right away.
+ * throughput - producers pushing empty tasks one by one and joining
+ *     them, for all the producer and worker counts.
+ * fanout - a thread pushing a batch of tasks and joining all of them.
+ * fork_join - tasks recursively splitting into two joined subtasks.
+ * mixed - short tasks pushed while long ones occupy the workers.
+ * arrays - memory-bound kernels, reported as triad and reduce, run
+ *     with thread_pool_parallel_for() and thread_pool_parallel_reduce()
+ *     on pools of growing size, then on the biggest one with the
+ *     workers pinned in both ways. With the arrays much bigger than
+ *     the caches the speedup shows how well the pool spreads the work
+ *     until the memory bandwidth is saturated.
+ */
+
+enum {
+	LATENCY_OPS = 20000,
+	THROUGHPUT_TASKS = 100000,
+	THROUGHPUT_BATCH = 100,
+	FANOUT_WIDTH = 1000,
+	FANOUT_ROUNDS = 200,
+	FORK_JOIN_DEPTH = 10,
+	FORK_JOIN_ROUNDS = 100,
+	MIXED_SHORT = 20000,
+	/* Every such short task is followed by a long one */
+	MIXED_LONG_PERIOD = 100,
+	MIXED_LONG_NS = 1000000,
+	ARRAY_SIZE = 1 << 23,
+	ARRAY_ROUNDS = 10,
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Latencies of the operations of one benchmark configuration */
+struct samples {
+	uint64_t *ns;
+	int count;
+	int capacity;
+};
+
+static void
+samples_create(struct samples *s, int capacity)
+{
+	s->ns = malloc(sizeof(*s->ns) * capacity);
+	s->count = 0;
+	s->capacity = capacity;
+}
+
+static void
+samples_add(struct samples *s, uint64_t ns)
+{
+	if (s->count < s->capacity)
+		s->ns[s->count++] = ns;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t
+samples_percentile(const struct samples *s, double p)
+{
+	if (s->count == 0)
+		return 0;
+	int i = (int)(p * (s->count - 1) + 0.5);
+	return s->ns[i];
+}
+
+/*
+ * Prints the line of a configuration. @a ops operations took
+ * @a elapsed_ns in total, @a extra is more JSON fields or NULL.
+ */
+static void
+report(const char *bench, int workers, int producers, int64_t ops,
+       uint64_t elapsed_ns, struct samples *s, const char *extra)
+{
+	qsort(s->ns, s->count, sizeof(*s->ns), cmp_u64);
+	printf("{\"bench\":\"%s\",\"workers\":%d,\"producers\":%d,"
+	       "\"ops\":%lld,\"ops_per_sec\":%.0f,\"p50_ns\":%llu,"
+	       "\"p99_ns\":%llu,\"p999_ns\":%llu%s%s}\n", bench, workers,
+	       producers, (long long)ops, ops * 1e9 / elapsed_ns,
+	       (unsigned long long)samples_percentile(s, 0.5),
+	       (unsigned long long)samples_percentile(s, 0.99),
+	       (unsigned long long)samples_percentile(s, 0.999),
+	       extra != NULL ? "," : "", extra != NULL ? extra : "");
+	fflush(stdout);
+	s->count = 0;
+}
+
+static struct thread_pool *
+pool_new(int workers)
+{
+	struct thread_pool *pool;
+	if (thread_pool_new(workers, &pool) != 0)
+		exit(1);
+	return pool;
+}
+
+static void *
+empty_task_f(void *arg)
+{
+	return arg;
+}
+
+/* Runs all the workers once, so the thread creation is not measured */
+static void
+pool_warm_up(struct thread_pool *pool, int workers)
+{
+	struct thread_task *tasks[TPOOL_MAX_THREADS * 4];
+	int count = workers * 4;
+	for (int i = 0; i < count; ++i)
+		thread_pool_task_new(pool, &tasks[i], empty_task_f, NULL);
+	if (thread_pool_push_tasks(pool, tasks, count) != 0)
+		exit(1);
+	for (int i = 0; i < count; ++i) {
+		void *result;
+		thread_task_join(tasks[i], &result);
+		thread_task_delete(tasks[i]);
+	}
+}
+
+static void
+bench_latency(int max_threads)
+{
+	struct samples s;
+	samples_create(&s, LATENCY_OPS);
+	for (int workers = 1;; workers *= 2) {
+		if (workers > max_threads)
+			workers = max_threads;
+		struct thread_pool *pool = pool_new(workers);
+		pool_warm_up(pool, workers);
+		struct thread_task *task;
+		thread_pool_task_new(pool, &task, empty_task_f, NULL);
+		uint64_t start = now_ns();
+		for (int i = 0; i < LATENCY_OPS; ++i) {
+			uint64_t op_start = now_ns();
+			if (thread_pool_push_task(pool, task) != 0)
+				exit(1);
+			void *result;
+			thread_task_join(task, &result);
+			samples_add(&s, now_ns() - op_start);
+		}
+		report("latency", workers, 1, LATENCY_OPS, now_ns() - start,
+		       &s, NULL);
+		thread_task_delete(task);
+		thread_pool_delete(pool);
+		if (workers == max_threads)
+			break;
+	}
+	free(s.ns);
+}
+
+struct producer {
+	struct thread_pool *pool;
+	int task_count;
+	struct samples samples;
+};
+
+static void *
+producer_f(void *arg)
+{
+	struct producer *p = arg;
+	struct thread_task *tasks[THROUGHPUT_BATCH];
+	for (int i = 0; i < THROUGHPUT_BATCH; ++i)
+		thread_pool_task_new(p->pool, &tasks[i], empty_task_f, NULL);
+	for (int done = 0; done < p->task_count; done += THROUGHPUT_BATCH) {
+		uint64_t start = now_ns();
+		for (int i = 0; i < THROUGHPUT_BATCH; ++i) {
+			if (thread_pool_push_task(p->pool, tasks[i]) != 0)
+				exit(1);
+		}
+		for (int i = 0; i < THROUGHPUT_BATCH; ++i) {
+			void *result;
+			thread_task_join(tasks[i], &result);
+		}
+		/* The time per task of the batch */
+		samples_add(&p->samples,
+			    (now_ns() - start) / THROUGHPUT_BATCH);
+	}
+	for (int i = 0; i < THROUGHPUT_BATCH; ++i)
+		thread_task_delete(tasks[i]);
+	return NULL;
+}
+
+static void
+bench_throughput(int max_threads)
+{
+	struct samples s;
+	samples_create(&s, THROUGHPUT_TASKS / THROUGHPUT_BATCH);
+	pthread_t threads[TPOOL_MAX_THREADS];
+	struct producer producers[TPOOL_MAX_THREADS];
+	for (int workers = 1;; workers *= 2) {
+		if (workers > max_threads)
+			workers = max_threads;
+		struct thread_pool *pool = pool_new(workers);
+		pool_warm_up(pool, workers);
+		for (int count = 1;; count *= 2) {
+			if (count > max_threads)
+				count = max_threads;
+			int per_producer = THROUGHPUT_TASKS / count /
+					   THROUGHPUT_BATCH * THROUGHPUT_BATCH;
+			uint64_t start = now_ns();
+			for (int i = 0; i < count; ++i) {
+				producers[i].pool = pool;
+				producers[i].task_count = per_producer;
+				samples_create(&producers[i].samples,
+					       per_producer / THROUGHPUT_BATCH);
+				pthread_create(&threads[i], NULL, producer_f,
+					       &producers[i]);
+			}
+			for (int i = 0; i < count; ++i)
+				pthread_join(threads[i], NULL);
+			uint64_t elapsed = now_ns() - start;
+			for (int i = 0; i < count; ++i) {
+				struct samples *ps = &producers[i].samples;
+				for (int j = 0; j < ps->count; ++j)
+					samples_add(&s, ps->ns[j]);
+				free(ps->ns);
+			}
+			report("throughput", workers, count,
+			       (int64_t)per_producer * count, elapsed, &s,
+			       NULL);
+			if (count == max_threads)
+				break;
+		}
+		thread_pool_delete(pool);
+		if (workers == max_threads)
+			break;
+	}
+	free(s.ns);
+}
+
+static void
+bench_fanout(int max_threads)
+{
+	struct samples s;
+	samples_create(&s, FANOUT_ROUNDS);
+	struct thread_pool *pool = pool_new(max_threads);
+	pool_warm_up(pool, max_threads);
+	struct thread_task **tasks = malloc(sizeof(*tasks) * FANOUT_WIDTH);
+	for (int i = 0; i < FANOUT_WIDTH; ++i)
+		thread_pool_task_new(pool, &tasks[i], empty_task_f, NULL);
+	uint64_t start = now_ns();
+	for (int r = 0; r < FANOUT_ROUNDS; ++r) {
+		uint64_t op_start = now_ns();
+		if (thread_pool_push_tasks(pool, tasks, FANOUT_WIDTH) != 0)
+			exit(1);
+		for (int i = 0; i < FANOUT_WIDTH; ++i) {
+			void *result;
+			thread_task_join(tasks[i], &result);
+		}
+		samples_add(&s, now_ns() - op_start);
+	}
+	char extra[64];
+	snprintf(extra, sizeof(extra), "\"width\":%d", FANOUT_WIDTH);
+	report("fanout", max_threads, 1, FANOUT_ROUNDS, now_ns() - start, &s,
+	       extra);
+	for (int i = 0; i < FANOUT_WIDTH; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+	thread_pool_delete(pool);
+	free(s.ns);
+}
+
+struct fork_join_arg {
+	struct thread_pool *pool;
+	int depth;
+};
+
+/* Splits into two subtasks until the depth is exhausted */
+static void *
+fork_join_f(void *arg)
+{
+	struct fork_join_arg *a = arg;
+	if (a->depth == 0)
+		return NULL;
+	struct fork_join_arg args[2];
+	struct thread_task *tasks[2];
+	for (int i = 0; i < 2; ++i) {
+		args[i].pool = a->pool;
+		args[i].depth = a->depth - 1;
+		thread_pool_task_new(a->pool, &tasks[i], fork_join_f, &args[i]);
+		if (thread_pool_push_task(a->pool, tasks[i]) != 0)
+			exit(1);
+	}
+	for (int i = 0; i < 2; ++i) {
+		void *result;
+		thread_task_join(tasks[i], &result);
+		thread_task_delete(tasks[i]);
+	}
+	return NULL;
+}
+
+static void
+bench_fork_join(int max_threads)
+{
+	struct samples s;
+	samples_create(&s, FORK_JOIN_ROUNDS);
+	struct thread_pool *pool = pool_new(max_threads);
+	pool_warm_up(pool, max_threads);
+	struct fork_join_arg root_arg = {pool, FORK_JOIN_DEPTH};
+	struct thread_task *root;
+	thread_pool_task_new(pool, &root, fork_join_f, &root_arg);
+	uint64_t start = now_ns();
+	for (int r = 0; r < FORK_JOIN_ROUNDS; ++r) {
+		uint64_t op_start = now_ns();
+		if (thread_pool_push_task(pool, root) != 0)
+			exit(1);
+		void *result;
+		thread_task_join(root, &result);
+		samples_add(&s, now_ns() - op_start);
+	}
+	char extra[64];
+	snprintf(extra, sizeof(extra), "\"tasks_per_op\":%d",
+		 (2 << FORK_JOIN_DEPTH) - 1);
+	report("fork_join", max_threads, 1, FORK_JOIN_ROUNDS,
+	       now_ns() - start, &s, extra);
+	thread_task_delete(root);
+	thread_pool_delete(pool);
+	free(s.ns);
+}
+
+static void *
+long_task_f(void *arg)
+{
+	uint64_t end = now_ns() + MIXED_LONG_NS;
+	while (now_ns() < end)
+		;
+	return arg;
+}
+
+static void
+bench_mixed(int max_threads)
+{
+	struct samples s;
+	samples_create(&s, MIXED_SHORT);
+	struct thread_pool *pool = pool_new(max_threads);
+	pool_warm_up(pool, max_threads);
+	int long_count = MIXED_SHORT / MIXED_LONG_PERIOD;
+	struct thread_task **longs = malloc(sizeof(*longs) * long_count);
+	for (int i = 0; i < long_count; ++i)
+		thread_pool_task_new(pool, &longs[i], long_task_f, NULL);
+	struct thread_task *task;
+	thread_pool_task_new(pool, &task, empty_task_f, NULL);
+	uint64_t start = now_ns();
+	for (int i = 0; i < MIXED_SHORT; ++i) {
+		if (i % MIXED_LONG_PERIOD == 0 &&
+		    thread_pool_push_task(pool, longs[i / MIXED_LONG_PERIOD]) !=
+		    0)
+			exit(1);
+		uint64_t op_start = now_ns();
+		if (thread_pool_push_task(pool, task) != 0)
+			exit(1);
+		void *result;
+		thread_task_join(task, &result);
+		samples_add(&s, now_ns() - op_start);
+	}
+	for (int i = 0; i < long_count; ++i) {
+		void *result;
+		thread_task_join(longs[i], &result);
+		thread_task_delete(longs[i]);
+	}
+	char extra[64];
+	snprintf(extra, sizeof(extra), "\"long_tasks\":%d,\"long_ns\":%d",
+		 long_count, MIXED_LONG_NS);
+	report("mixed", max_threads, 1, MIXED_SHORT, now_ns() - start, &s,
+	       extra);
+	thread_task_delete(task);
+	free(longs);
+	thread_pool_delete(pool);
+	free(s.ns);
+}
+
+struct triad {
+	double *a;
+	const double *b;
+	const double *c;
+	double scale;
+};
+
+static void
+triad_f(int64_t begin, int64_t end, void *ctx)
+{
+	struct triad *t = ctx;
+	for (int64_t i = begin; i < end; ++i)
+		t->a[i] = t->b[i] + t->scale * t->c[i];
+}
+
+static void
+sum_f(int64_t begin, int64_t end, void *acc, void *ctx)
+{
+	const double *a = ctx;
+	double sum = 0;
+	for (int64_t i = begin; i < end; ++i)
+		sum += a[i];
+	*(double *)acc += sum;
+}
+
+static void
+combine_f(void *acc, const void *other, void *ctx)
+{
+	(void)ctx;
+	*(double *)acc += *(const double *)other;
+}
+
+/* Runs both kernels on @a pool and reports them */
+static void
+bench_arrays_on(struct thread_pool *pool, struct triad *t, int workers,
+		const char *affinity)
+{
+	struct samples s;
+	samples_create(&s, ARRAY_ROUNDS);
+	/* Warm up: start the workers and touch the pages */
+	thread_pool_parallel_for(pool, 0, ARRAY_SIZE, 0, triad_f, t);
+	uint64_t start = now_ns();
+	for (int r = 0; r < ARRAY_ROUNDS; ++r) {
+		uint64_t op_start = now_ns();
+		thread_pool_parallel_for(pool, 0, ARRAY_SIZE, 0, triad_f, t);
+		samples_add(&s, now_ns() - op_start);
+	}
+	uint64_t elapsed = now_ns() - start;
+	/* Two arrays read and one written per round */
+	double bytes = 3.0 * sizeof(double) * ARRAY_SIZE * ARRAY_ROUNDS;
+	char extra[128];
+	snprintf(extra, sizeof(extra),
+		 "\"affinity\":\"%s\",\"size\":%d,\"gb_per_sec\":%.2f",
+		 affinity, ARRAY_SIZE, bytes / elapsed);
+	report("triad", workers, 1, ARRAY_ROUNDS, elapsed, &s, extra);
+
+	double sum = 0;
+	start = now_ns();
+	for (int r = 0; r < ARRAY_ROUNDS; ++r) {
+		uint64_t op_start = now_ns();
+		sum = 0;
+		thread_pool_parallel_reduce(pool, 0, ARRAY_SIZE, 0, sum_f,
+					    combine_f, t->a, &sum,
+					    sizeof(sum));
+		samples_add(&s, now_ns() - op_start);
+	}
+	elapsed = now_ns() - start;
+	if (sum <= 0)
+		exit(1);
+	snprintf(extra, sizeof(extra), "\"affinity\":\"%s\",\"size\":%d",
+		 affinity, ARRAY_SIZE);
+	report("reduce", workers, 1, ARRAY_ROUNDS, elapsed, &s, extra);
+	free(s.ns);
+}
+
+static void
+bench_arrays(int max_threads)
+{
+	struct triad t;
+	t.a = malloc(sizeof(double) * ARRAY_SIZE);
+	double *b = malloc(sizeof(double) * ARRAY_SIZE);
+	double *c = malloc(sizeof(double) * ARRAY_SIZE);
+	for (int i = 0; i < ARRAY_SIZE; ++i) {
+		t.a[i] = 0;
+		b[i] = i;
+		c[i] = ARRAY_SIZE - i;
+	}
+	t.b = b;
+	t.c = c;
+	t.scale = 3;
+	/* Scaling with the pool size */
+	for (int workers = 1;; workers *= 2) {
+		if (workers > max_threads)
+			workers = max_threads;
+		struct thread_pool *pool = pool_new(workers);
+		bench_arrays_on(pool, &t, workers, "none");
+		thread_pool_delete(pool);
+		if (workers == max_threads)
+			break;
+	}
+	/* The biggest pool pinned in both ways */
+	static const char *names[] = {"compact", "round-robin"};
+	const int affinities[] = {TPOOL_AFFINITY_COMPACT,
+				  TPOOL_AFFINITY_ROUND_ROBIN};
+	for (int i = 0; i < 2; ++i) {
+		struct thread_pool_options opts;
+		thread_pool_options_init(&opts);
+		opts.max_thread_count = max_threads;
+		opts.affinity = affinities[i];
+		struct thread_pool *pool;
+		if (thread_pool_new_ex(&opts, &pool) != 0)
+			exit(1);
+		bench_arrays_on(pool, &t, max_threads, names[i]);
+		thread_pool_delete(pool);
+	}
+	free(t.a);
+	free(b);
+	free(c);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(int max_threads);
+} benches[] = {
+	{"latency", bench_latency},
+	{"throughput", bench_throughput},
+	{"fanout", bench_fanout},
+	{"fork_join", bench_fork_join},
+	{"mixed", bench_mixed},
+	{"arrays", bench_arrays},
+};
+
+int
+main(int argc, char **argv)
+{
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = cpu_count < TPOOL_MAX_THREADS ? cpu_count :
+			  TPOOL_MAX_THREADS;
+	int bench_count = sizeof(benches) / sizeof(benches[0]);
+	for (int i = 1; i < argc; ++i) {
+		bool is_found = false;
+		for (int j = 0; j < bench_count; ++j)
+			is_found = is_found ||
+				   strcmp(argv[i], benches[j].name) == 0;
+		if (!is_found) {
+			fprintf(stderr, "unknown benchmark %s\n", argv[i]);
+			return 1;
+		}
+	}
+	for (int j = 0; j < bench_count; ++j) {
+		bool is_selected = argc == 1;
+		for (int i = 1; i < argc; ++i)
+			is_selected = is_selected ||
+				      strcmp(argv[i], benches[j].name) == 0;
+		if (is_selected)
+			benches[j].run(max_threads);
+	}
+	return 0;
+}
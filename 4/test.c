@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
+#include <sched.h>
 #include "thread_pool.h"
 #include "unit.h"
+#include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 static void
 test_new(void)
@@ -254,6 +260,2023 @@ test_thread_pool_max_tasks(void)
 }
 
 
+struct producer_ctx {
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	int count;
+	int *arg;
+};
+
+static void *
+producer_f(void *arg)
+{
+	struct producer_ctx *ctx = arg;
+	for (int i = 0; i < ctx->count; ++i) {
+		unit_fail_if(thread_task_new(&ctx->tasks[i], task_incr_f,
+					     ctx->arg) != 0);
+		unit_fail_if(thread_pool_push_task(ctx->pool,
+						   ctx->tasks[i]) != 0);
+	}
+	return NULL;
+}
+
+static void
+test_push_many_producers(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	enum { producer_count = 4, per_producer = 10000 };
+	pthread_t producers[producer_count];
+	struct producer_ctx ctx[producer_count];
+	struct thread_task **tasks =
+		malloc(sizeof(*tasks) * producer_count * per_producer);
+	int arg = 0;
+	/*
+	 * Several threads push into the same pool concurrently.
+	 */
+	for (int i = 0; i < producer_count; ++i) {
+		ctx[i].pool = p;
+		ctx[i].tasks = &tasks[i * per_producer];
+		ctx[i].count = per_producer;
+		ctx[i].arg = &arg;
+		unit_fail_if(pthread_create(&producers[i], NULL, producer_f,
+					    &ctx[i]) != 0);
+	}
+	for (int i = 0; i < producer_count; ++i)
+		pthread_join(producers[i], NULL);
+	for (int i = 0; i < producer_count * per_producer; ++i) {
+		void *result;
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(result != &arg);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(arg == producer_count * per_producer,
+		   "all the tasks from all the producers are done");
+	free(tasks);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_push_batch(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const int count = 1000;
+	struct thread_task **tasks = malloc(sizeof(*tasks) * count);
+	int arg = 0;
+	void *result;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative batch size");
+	unit_check(thread_pool_push_tasks(p, tasks, 0) == 0, "empty batch");
+	/*
+	 * Normal batch.
+	 */
+	unit_check(thread_pool_push_tasks(p, tasks, count) == 0,
+		   "pushed a batch");
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(result != &arg);
+	}
+	unit_check(arg == count, "all the batch is done");
+	/*
+	 * A batch which does not fit is not pushed at all.
+	 */
+	arg = 0;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	struct thread_task **big = malloc(sizeof(*big) * TPOOL_MAX_TASKS);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i)
+		big[i] = tasks[i % count];
+	unit_check(thread_pool_push_tasks(p, big, TPOOL_MAX_TASKS) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "too big batch");
+	unit_check(thread_task_join(tasks[0], &result) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "nothing from the batch is pushed");
+	free(big);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	free(tasks);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_task_cache(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const int count = 500;
+	struct thread_task **tasks = malloc(sizeof(*tasks) * count);
+	int arg = 0;
+	void *result;
+	uint64_t alloc_count = 0;
+	/*
+	 * The first round fills the cache, the next ones must reuse it.
+	 */
+	for (int round = 0; round < 10; ++round) {
+		for (int i = 0; i < count; ++i) {
+			unit_fail_if(thread_pool_task_new(p, &tasks[i],
+							  task_incr_f, &arg) != 0);
+			unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+		}
+		for (int i = 0; i < count; ++i) {
+			unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+			unit_fail_if(result != &arg);
+			unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		}
+		if (round == 0)
+			alloc_count = thread_pool_task_alloc_count(p);
+	}
+	unit_check(arg == 10 * count, "all the tasks are done");
+	unit_check(alloc_count > 0, "the cache was filled");
+	unit_check(thread_pool_task_alloc_count(p) == alloc_count,
+		   "no allocations in the steady state");
+	/*
+	 * Detached tasks go back to the cache too.
+	 */
+	arg = 0;
+	for (int i = 0; i < count; ++i) {
+		struct thread_task *t;
+		unit_fail_if(thread_pool_task_new(p, &t, task_incr_f,
+						  &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_detach(t) != 0);
+	}
+	while (__atomic_load_n(&arg, __ATOMIC_RELAXED) != count)
+		usleep(100);
+	unit_check(thread_pool_task_alloc_count(p) == alloc_count,
+		   "detached tasks are recycled");
+	/*
+	 * The pool can't be deleted while its tasks are alive.
+	 */
+	struct thread_task *t;
+	unit_fail_if(thread_pool_task_new(p, &t, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "delete with not deleted cached tasks");
+	unit_fail_if(thread_task_delete(t) != 0);
+	free(tasks);
+	unit_check(thread_pool_delete(p) == 0, "delete after the detached ones");
+
+	unit_test_finish();
+}
+
+struct inline_sum {
+	int64_t a;
+	int64_t b;
+};
+
+static void *
+task_inline_sum_f(void *arg)
+{
+	struct inline_sum *s = arg;
+	int64_t sum = s->a + s->b;
+	/* The result replaces the argument */
+	memcpy(arg, &sum, sizeof(sum));
+	return arg;
+}
+
+static void
+test_inline_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	struct thread_task *t;
+	char big[TPOOL_TASK_INLINE_SIZE + 1] = {0};
+	unit_check(thread_task_new_inline(&t, task_inline_sum_f, big,
+					  sizeof(big)) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too big inline argument");
+	/*
+	 * The argument is copied, the caller's one can go right away.
+	 */
+	struct inline_sum arg = { .a = 2, .b = 3 };
+	void *result;
+	int64_t sum;
+	unit_fail_if(thread_task_new_inline(&t, task_inline_sum_f, &arg,
+					    sizeof(arg)) != 0);
+	arg.a = 100;
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(result == thread_task_inline_data(t),
+		   "the function gets the inline copy");
+	memcpy(&sum, thread_task_inline_data(t), sizeof(sum));
+	unit_check(sum == 5, "inline result");
+	/* A new argument for the next push is written in place */
+	arg.a = 10;
+	memcpy(thread_task_inline_data(t), &arg, sizeof(arg));
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	memcpy(&sum, thread_task_inline_data(t), sizeof(sum));
+	unit_check(sum == 13, "reused with a new inline argument");
+	unit_fail_if(thread_task_delete(t) != 0);
+	/*
+	 * Cached inline tasks do no allocations in the steady state.
+	 */
+	enum { count = 500 };
+	struct thread_task *tasks[count];
+	uint64_t alloc_count = 0;
+	bool is_ok = true;
+	for (int round = 0; round < 5; ++round) {
+		for (int i = 0; i < count; ++i) {
+			arg.a = i;
+			arg.b = round;
+			unit_fail_if(thread_pool_task_new_inline(
+				p, &tasks[i], task_inline_sum_f, &arg,
+				sizeof(arg)) != 0);
+			unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+		}
+		for (int i = 0; i < count; ++i) {
+			unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+			memcpy(&sum, result, sizeof(sum));
+			is_ok = is_ok && sum == i + round;
+			unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		}
+		if (round == 0)
+			alloc_count = thread_pool_task_alloc_count(p);
+	}
+	unit_check(is_ok, "all the inline results are right");
+	unit_check(thread_pool_task_alloc_count(p) == alloc_count,
+		   "no allocations for inline tasks");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_task_state(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &arg) != 0);
+	unit_check(!thread_task_is_running(t) && !thread_task_is_finished(t),
+		   "new task is neither running nor finished");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	while (!thread_task_is_running(t))
+		usleep(100);
+	unit_check(!thread_task_is_finished(t), "running task is not finished");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	while (!thread_task_is_finished(t))
+		usleep(100);
+	unit_check(!thread_task_is_running(t), "finished task is not running");
+	unit_check(thread_task_delete(t) == TPOOL_ERR_TASK_IN_POOL,
+		   "finished task can't be deleted before join");
+	unit_check(thread_task_join(t, &result) == 0 && result == &arg,
+		   "join of a finished task");
+	unit_check(thread_task_join(t, &result) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "joined task is not in the pool anymore");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_idle_workers(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	/*
+	 * Bursts separated by idle periods are served by the same parked
+	 * worker, no new threads are created for them.
+	 */
+	for (int i = 0; i < 20; ++i) {
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+		usleep(2000);
+	}
+	unit_check(arg == 20, "all the bursts are done");
+	unit_check(thread_pool_thread_count(p) == 1,
+		   "parked worker is reused");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_idle_timeout(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_options opts;
+	thread_pool_options_init(&opts);
+	opts.max_thread_count = 0;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "0 thread count is forbidden");
+	opts.max_thread_count = 3;
+	opts.idle_timeout = -1;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "negative idle timeout is forbidden");
+	opts.idle_timeout = 0.05;
+	unit_check(thread_pool_new_ex(&opts, &p) == 0, "created with options");
+
+	int arg = 0;
+	void *result;
+	struct thread_task *tasks[3];
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	while (thread_pool_thread_count(p) != 3)
+		usleep(100);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	/*
+	 * Idle workers go away after the timeout.
+	 */
+	int waited_ms = 0;
+	while (thread_pool_thread_count(p) != 0 && waited_ms < 5000) {
+		usleep(1000);
+		++waited_ms;
+	}
+	unit_check(thread_pool_thread_count(p) == 0, "idle workers exited");
+	/*
+	 * And are started again when there is work.
+	 */
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(thread_pool_thread_count(p) > 0, "workers are back");
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * An infinite timeout is the same as none.
+	 */
+	opts.idle_timeout = NAN;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "NaN idle timeout is forbidden");
+	opts.idle_timeout = INFINITY;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	arg = 0;
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	while (thread_pool_thread_count(p) != 3)
+		usleep(100);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	usleep(100000);
+	unit_check(thread_pool_thread_count(p) == 3,
+		   "idle workers stay with an infinite timeout");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct order_log {
+	int next;
+	int ids[128];
+};
+
+struct order_arg {
+	struct order_log *log;
+	int id;
+};
+
+static void *
+task_log_order_f(void *arg)
+{
+	struct order_arg *a = arg;
+	int pos = __atomic_fetch_add(&a->log->next, 1, __ATOMIC_RELAXED);
+	a->log->ids[pos] = a->id;
+	return arg;
+}
+
+static void
+test_priorities(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	int arg = 0;
+	void *result;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &arg) != 0);
+	unit_check(thread_task_set_priority(t, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative priority");
+	unit_check(thread_task_set_priority(t, TPOOL_PRIORITY_COUNT) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too big priority");
+	unit_check(thread_task_set_priority(t, TPOOL_PRIORITY_HIGH) == 0,
+		   "set priority");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_set_priority(t, TPOOL_PRIORITY_LOW) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't change priority in the pool");
+	/*
+	 * Keep the only worker busy while the queues are filled.
+	 */
+	while (!thread_task_is_running(t))
+		usleep(100);
+	enum { high_count = 64, low_count = 8 };
+	struct order_log log = { .next = 0 };
+	struct order_arg high_arg = { .log = &log,
+				      .id = TPOOL_PRIORITY_HIGH };
+	struct order_arg low_arg = { .log = &log,
+				     .id = TPOOL_PRIORITY_LOW };
+	struct thread_task *tasks[high_count + low_count];
+	for (int i = 0; i < low_count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_log_order_f,
+					     &low_arg) != 0);
+		unit_fail_if(thread_task_set_priority(tasks[i],
+						      TPOOL_PRIORITY_LOW) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	for (int i = low_count; i < low_count + high_count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_log_order_f,
+					     &high_arg) != 0);
+		unit_fail_if(thread_task_set_priority(tasks[i],
+						      TPOOL_PRIORITY_HIGH) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_check(thread_pool_queue_depth(p, TPOOL_PRIORITY_HIGH) ==
+		   high_count, "high queue depth");
+	unit_check(thread_pool_queue_depth(p, TPOOL_PRIORITY_NORMAL) == 0,
+		   "normal queue depth");
+	unit_check(thread_pool_queue_depth(p, TPOOL_PRIORITY_LOW) ==
+		   low_count, "low queue depth");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	/*
+	 * A join would run the awaited task right away, so let the worker
+	 * alone decide the order.
+	 */
+	while (thread_pool_queue_depth(p, TPOOL_PRIORITY_HIGH) != 0 ||
+	       thread_pool_queue_depth(p, TPOOL_PRIORITY_LOW) != 0)
+		usleep(100);
+	for (int i = 0; i < low_count + high_count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	/*
+	 * High priority tasks go first, but the low ones are not starved
+	 * until the high queue is drained.
+	 */
+	int first_low = -1;
+	for (int i = 0; i < low_count + high_count && first_low < 0; ++i) {
+		if (log.ids[i] == TPOOL_PRIORITY_LOW)
+			first_low = i;
+	}
+	unit_check(log.ids[0] == TPOOL_PRIORITY_HIGH,
+		   "high priority task is run first");
+	unit_check(first_low > 0 && first_low < high_count,
+		   "low priority task is run before the high queue is empty");
+	unit_check(thread_pool_queue_depth(p, TPOOL_PRIORITY_HIGH) == 0 &&
+		   thread_pool_queue_depth(p, TPOOL_PRIORITY_LOW) == 0,
+		   "queues are empty");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static int
+order_position(const struct order_log *log, int id)
+{
+	for (int i = 0; i < log->next; ++i) {
+		if (log->ids[i] == id)
+			return i;
+	}
+	return -1;
+}
+
+static void
+test_continuations(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	struct order_log log = { .next = 0 };
+	struct order_arg args[4];
+	struct thread_task *t[4];
+	int arg = 0;
+	void *result;
+	for (int i = 0; i < 4; ++i) {
+		args[i].log = &log;
+		args[i].id = i;
+		unit_fail_if(thread_task_new(&t[i], task_log_order_f,
+					     &args[i]) != 0);
+	}
+	unit_check(thread_task_then(t[0], t[0]) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "task can't wait for itself");
+	/*
+	 * Diamond: 0 -> {1, 2} -> 3. The dependent tasks are pushed first
+	 * and wait.
+	 */
+	unit_check(thread_task_then(t[0], t[1]) == 0, "1 waits for 0");
+	unit_check(thread_task_then(t[0], t[2]) == 0, "2 waits for 0");
+	unit_fail_if(thread_task_then(t[1], t[3]) != 0);
+	unit_fail_if(thread_task_then(t[2], t[3]) != 0);
+	unit_check(thread_task_delete(t[3]) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't delete a task waiting for others");
+	unit_fail_if(thread_pool_push_task(p, t[3]) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, &t[1], 2) != 0);
+	unit_check(thread_task_then(t[0], t[3]) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't add a dependency to a pushed task");
+	usleep(10000);
+	unit_check(log.next == 0 && !thread_task_is_finished(t[3]),
+		   "dependent tasks wait");
+	unit_fail_if(thread_pool_push_task(p, t[0]) != 0);
+	unit_check(thread_task_join(t[3], &result) == 0 && result == &args[3],
+		   "joined the last task");
+	unit_check(log.next == 4, "all the tasks are done");
+	unit_check(order_position(&log, 0) == 0 &&
+		   order_position(&log, 3) == 3, "dependencies are respected");
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_task_join(t[i], &result) != 0);
+	/*
+	 * Waiting for a finished task is a no-op.
+	 */
+	log.next = 0;
+	unit_fail_if(thread_pool_push_task(p, t[0]) != 0);
+	while (!thread_task_is_finished(t[0]))
+		usleep(100);
+	unit_check(thread_task_then(t[0], t[1]) == 0, "wait for finished");
+	unit_fail_if(thread_pool_push_task(p, t[1]) != 0);
+	unit_check(thread_task_join(t[1], &result) == 0,
+		   "the task is run right away");
+	unit_fail_if(thread_task_join(t[0], &result) != 0);
+	/*
+	 * Deleting a not pushed task releases the tasks waiting for it.
+	 */
+	unit_fail_if(thread_task_then(t[0], t[1]) != 0);
+	unit_fail_if(thread_pool_push_task(p, t[1]) != 0);
+	unit_fail_if(thread_task_delete(t[0]) != 0);
+	unit_check(thread_task_join(t[1], &result) == 0,
+		   "released by deletion of the dependency");
+	for (int i = 1; i < 4; ++i)
+		unit_fail_if(thread_task_delete(t[i]) != 0);
+	/*
+	 * A long chain of detached tasks runs strictly one by one.
+	 */
+	enum { chain_size = 1000 };
+	struct thread_task *last;
+	unit_fail_if(thread_task_new(&last, task_incr_f, &arg) != 0);
+	struct thread_task *next = last;
+	for (int i = 0; i < chain_size; ++i) {
+		struct thread_task *prev;
+		unit_fail_if(thread_pool_task_new(p, &prev, task_incr_f,
+						  &arg) != 0);
+		unit_fail_if(thread_task_then(prev, next) != 0);
+		if (next != last) {
+			unit_fail_if(thread_pool_push_task(p, next) != 0);
+			unit_fail_if(thread_task_detach(next) != 0);
+		}
+		next = prev;
+	}
+	unit_fail_if(thread_pool_push_task(p, last) != 0);
+	unit_fail_if(thread_pool_push_task(p, next) != 0);
+	unit_fail_if(thread_task_detach(next) != 0);
+	unit_check(thread_task_join(last, &result) == 0 &&
+		   arg == chain_size + 1, "the whole chain is done");
+	unit_fail_if(thread_task_delete(last) != 0);
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+
+	unit_test_finish();
+}
+
+static void
+loop_mark_f(int64_t begin, int64_t end, void *ctx)
+{
+	char *marks = ctx;
+	for (int64_t i = begin; i < end; ++i)
+		++marks[i];
+}
+
+static void
+reduce_sum_f(int64_t begin, int64_t end, void *acc, void *ctx)
+{
+	(void)ctx;
+	for (int64_t i = begin; i < end; ++i)
+		*(int64_t *)acc += i;
+}
+
+static void
+combine_sum_f(void *acc, const void *other, void *ctx)
+{
+	(void)ctx;
+	*(int64_t *)acc += *(const int64_t *)other;
+}
+
+/* Reduces a range to itself, checks the pieces come in order */
+struct span {
+	int64_t begin;
+	int64_t end;
+	bool is_ordered;
+};
+
+static void
+reduce_span_f(int64_t begin, int64_t end, void *acc, void *ctx)
+{
+	(void)ctx;
+	struct span *s = acc;
+	s->begin = begin;
+	s->end = end;
+}
+
+static void
+combine_span_f(void *acc, const void *other, void *ctx)
+{
+	(void)ctx;
+	struct span *s = acc;
+	const struct span *o = other;
+	if (o->begin < 0)
+		return;
+	if (s->begin < 0) {
+		*s = *o;
+		return;
+	}
+	s->is_ordered = s->is_ordered && o->is_ordered && s->end == o->begin;
+	s->end = o->end;
+}
+
+struct nested_loop {
+	struct thread_pool *pool;
+	char *marks;
+	int64_t size;
+};
+
+static void *
+task_nested_loop_f(void *arg)
+{
+	struct nested_loop *l = arg;
+	int rc = thread_pool_parallel_for(l->pool, 0, l->size, 100,
+					  loop_mark_f, l->marks);
+	return (void *)(intptr_t)rc;
+}
+
+static bool
+marks_are(const char *marks, int64_t size, char value)
+{
+	for (int64_t i = 0; i < size; ++i) {
+		if (marks[i] != value)
+			return false;
+	}
+	return true;
+}
+
+static void
+test_parallel_for(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	enum { size = 100000 };
+	char *marks = calloc(size, 1);
+	unit_check(thread_pool_parallel_for(p, 10, 0, 1, loop_mark_f,
+					    marks) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "reversed range");
+	unit_check(thread_pool_parallel_for(p, 0, 10, -1, loop_mark_f,
+					    marks) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "negative grain");
+	unit_check(thread_pool_parallel_for(p, 5, 5, 1, loop_mark_f,
+					    marks) == 0 && marks[5] == 0,
+		   "empty range");
+	/*
+	 * Each index is visited exactly once whatever the grain is.
+	 */
+	const int64_t grains[] = {0, 1, 7, 1000, size * 2};
+	for (int i = 0; i < (int)(sizeof(grains) / sizeof(grains[0])); ++i) {
+		unit_fail_if(thread_pool_parallel_for(p, 0, size, grains[i],
+						      loop_mark_f, marks) != 0);
+		unit_fail_if(!marks_are(marks, size, i + 1));
+	}
+	unit_check(true, "all indexes are visited once");
+	/*
+	 * Reduction.
+	 */
+	int64_t sum = 0;
+	unit_check(thread_pool_parallel_reduce(p, 0, size, 0, reduce_sum_f,
+					       combine_sum_f, NULL, &sum,
+					       0) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "0 result size");
+	unit_check(thread_pool_parallel_reduce(p, 0, size, 0, reduce_sum_f,
+					       combine_sum_f, NULL, &sum,
+					       sizeof(sum)) == 0 &&
+		   sum == (int64_t)size * (size - 1) / 2, "sum");
+	struct span span = { .begin = -1, .end = -1, .is_ordered = true };
+	unit_fail_if(thread_pool_parallel_reduce(p, 3, size, 10, reduce_span_f,
+						 combine_span_f, NULL, &span,
+						 sizeof(span)) != 0);
+	unit_check(span.is_ordered && span.begin == 3 && span.end == size,
+		   "partial results are combined in order");
+	/*
+	 * A loop started by a task in the same pool can't deadlock even
+	 * when all the workers do that.
+	 */
+	enum { nested_count = 8 };
+	struct nested_loop loops[nested_count];
+	struct thread_task *tasks[nested_count];
+	for (int i = 0; i < nested_count; ++i) {
+		loops[i].pool = p;
+		loops[i].marks = calloc(size, 1);
+		loops[i].size = size;
+		unit_fail_if(thread_task_new(&tasks[i], task_nested_loop_f,
+					     &loops[i]) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < nested_count; ++i) {
+		void *result;
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		is_ok = is_ok && result == NULL &&
+			marks_are(loops[i].marks, size, 1);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		free(loops[i].marks);
+	}
+	unit_check(is_ok, "nested loops");
+	free(marks);
+	unit_check(thread_pool_delete(p) == 0, "pool is free after the loops");
+
+	unit_test_finish();
+}
+
+static void *
+task_self_f(void *arg)
+{
+	*(pthread_t *)arg = pthread_self();
+	return arg;
+}
+
+struct fork_join_arg {
+	struct thread_pool *pool;
+	int depth;
+};
+
+/* Counts the leaves of a binary tree of tasks joining their children */
+static void *
+task_fork_join_f(void *arg)
+{
+	struct fork_join_arg *fj = arg;
+	if (fj->depth == 0)
+		return (void *)(intptr_t)1;
+	struct fork_join_arg child_args[2];
+	struct thread_task *children[2];
+	for (int i = 0; i < 2; ++i) {
+		child_args[i].pool = fj->pool;
+		child_args[i].depth = fj->depth - 1;
+		unit_fail_if(thread_pool_task_new(fj->pool, &children[i],
+						  task_fork_join_f,
+						  &child_args[i]) != 0);
+		unit_fail_if(thread_pool_push_task(fj->pool, children[i]) != 0);
+	}
+	intptr_t sum = 0;
+	for (int i = 0; i < 2; ++i) {
+		void *result;
+		unit_fail_if(thread_task_join(children[i], &result) != 0);
+		unit_fail_if(thread_task_delete(children[i]) != 0);
+		sum += (intptr_t)result;
+	}
+	return (void *)sum;
+}
+
+static void
+test_join_help(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	/*
+	 * The only worker is busy, so the joiner runs the task itself.
+	 */
+	int arg = 0;
+	void *result;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	pthread_t runner;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_self_f, &runner) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_join(t, &result) == 0 && result == &runner,
+		   "join a task queued behind a busy worker");
+	unit_check(pthread_equal(runner, pthread_self()),
+		   "the joiner runs the task");
+	unit_check(thread_task_is_running(blocker) &&
+		   thread_pool_queue_depth(p, TPOOL_PRIORITY_NORMAL) == 0,
+		   "the worker is still busy");
+	unit_fail_if(thread_task_delete(t) != 0);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	/*
+	 * Tasks joining their subtasks on a single worker would wait for
+	 * each other forever, unless the joins run the subtasks.
+	 */
+	enum { depth = 8 };
+	struct fork_join_arg root_arg = { .pool = p, .depth = depth };
+	struct thread_task *root;
+	unit_fail_if(thread_task_new(&root, task_fork_join_f, &root_arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, root) != 0);
+	while (!thread_task_is_finished(root))
+		usleep(100);
+	unit_check(thread_task_join(root, &result) == 0 &&
+		   (intptr_t)result == 1 << depth, "nested fork-join");
+	/* The same with the external joiner helping */
+	unit_fail_if(thread_pool_push_task(p, root) != 0);
+	unit_check(thread_task_join(root, &result) == 0 &&
+		   (intptr_t)result == 1 << depth, "nested fork-join helped");
+	unit_fail_if(thread_task_delete(root) != 0);
+	unit_check(thread_pool_delete(p) == 0, "pool is free after the joins");
+
+	unit_test_finish();
+}
+
+struct fiber_waiter_arg {
+	struct thread_task *child;
+	int *started;
+};
+
+static void *
+task_fiber_waiter_f(void *arg)
+{
+	struct fiber_waiter_arg *wa = arg;
+	__atomic_add_fetch(wa->started, 1, __ATOMIC_RELAXED);
+	void *result;
+	unit_fail_if(thread_task_join(wa->child, &result) != 0);
+	return result;
+}
+
+static void *
+task_return_arg_f(void *arg)
+{
+	return arg;
+}
+
+static void
+test_fibers(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options options;
+	thread_pool_options_init(&options);
+	options.fiber_stack_size = 1024;
+	struct thread_pool *p;
+	unit_check(thread_pool_new_ex(&options, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too small fiber stack");
+	options.max_thread_count = 2;
+	options.fiber_stack_size = 64 * 1024;
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+	/*
+	 * Far more tasks than workers wait in joins at once, each one
+	 * suspended on its fiber, until the gate lets their children go.
+	 */
+	enum { count = 1000 };
+	struct thread_task *gate;
+	unit_fail_if(thread_task_new(&gate, task_return_arg_f, NULL) != 0);
+	static struct thread_task *children[count];
+	static struct thread_task *waiters[count];
+	static struct fiber_waiter_arg args[count];
+	int started = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_pool_task_new(p, &children[i],
+						  task_return_arg_f,
+						  (void *)(intptr_t)i) != 0);
+		unit_fail_if(thread_task_then(gate, children[i]) != 0);
+		unit_fail_if(thread_pool_push_task(p, children[i]) != 0);
+		args[i].child = children[i];
+		args[i].started = &started;
+		unit_fail_if(thread_pool_task_new(p, &waiters[i],
+						  task_fiber_waiter_f,
+						  &args[i]) != 0);
+		unit_fail_if(thread_pool_push_task(p, waiters[i]) != 0);
+	}
+	while (__atomic_load_n(&started, __ATOMIC_RELAXED) < count)
+		usleep(100);
+	unit_check(thread_pool_queue_depth(p, TPOOL_PRIORITY_NORMAL) == 0,
+		   "all the waiters are started on 2 workers");
+	unit_check(thread_pool_thread_count(p) <= 2, "no more workers");
+	unit_fail_if(thread_pool_push_task(p, gate) != 0);
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		void *result;
+		unit_fail_if(thread_task_join(waiters[i], &result) != 0);
+		is_ok = is_ok && (intptr_t)result == i;
+		unit_fail_if(thread_task_delete(waiters[i]) != 0);
+		unit_fail_if(thread_task_delete(children[i]) != 0);
+	}
+	unit_check(is_ok, "the waiters are resumed with the results");
+	void *result;
+	unit_fail_if(thread_task_join(gate, &result) != 0);
+	unit_fail_if(thread_task_delete(gate) != 0);
+	/* Nested joins suspend and run the subtasks on the fibers */
+	enum { depth = 8 };
+	struct fork_join_arg root_arg = { .pool = p, .depth = depth };
+	struct thread_task *root;
+	unit_fail_if(thread_task_new(&root, task_fork_join_f, &root_arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, root) != 0);
+	while (!thread_task_is_finished(root))
+		usleep(100);
+	unit_check(thread_task_join(root, &result) == 0 &&
+		   (intptr_t)result == 1 << depth, "nested fork-join on fibers");
+	unit_fail_if(thread_task_delete(root) != 0);
+	unit_check(thread_pool_delete(p) == 0, "pool is deleted");
+
+	unit_test_finish();
+}
+
+static void *
+task_wait_for_cancel_f(void *arg)
+{
+	while (!thread_task_is_cancel_requested())
+		usleep(100);
+	return arg;
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int counter = 0;
+	void *result;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &counter) != 0);
+	unit_check(thread_task_cancel(t) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "cancel a new task");
+	unit_check(!thread_task_is_cancel_requested(),
+		   "no cancel requests outside of tasks");
+	/*
+	 * Queued tasks are taken out of the queue.
+	 */
+	int arg = 0;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_cancel(t) == 0, "cancel a queued task");
+	unit_check(thread_task_is_finished(t) &&
+		   thread_pool_queue_depth(p, TPOOL_PRIORITY_NORMAL) == 0,
+		   "the task left the queue");
+	unit_check(thread_task_join(t, &result) == TPOOL_ERR_TASK_CANCELLED &&
+		   result == NULL, "join a cancelled task");
+	unit_check(counter == 0, "the task did not run");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_join(t, &result) == 0 && counter == 1,
+		   "reuse a cancelled task");
+	/*
+	 * A task waiting for a predecessor is not run, while its own
+	 * successor is released.
+	 */
+	struct thread_task *parent, *child;
+	unit_fail_if(thread_task_new(&parent, task_incr_f, &counter) != 0);
+	unit_fail_if(thread_task_new(&child, task_incr_f, &counter) != 0);
+	unit_fail_if(thread_task_then(parent, t) != 0);
+	unit_fail_if(thread_task_then(t, child) != 0);
+	unit_fail_if(thread_pool_push_task(p, parent) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_pool_push_task(p, child) != 0);
+	unit_check(thread_task_cancel(t) == 0, "cancel a dependent task");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(parent, &result) != 0);
+	unit_fail_if(thread_task_join(child, &result) != 0);
+	unit_check(thread_task_join(t, &result) == TPOOL_ERR_TASK_CANCELLED,
+		   "the dependent task is cancelled");
+	unit_check(counter == 3, "the others ran");
+	/*
+	 * Started tasks can only be asked to stop.
+	 */
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	while (!thread_task_is_finished(t))
+		usleep(100);
+	unit_check(thread_task_cancel(t) == TPOOL_ERR_TASK_STARTED,
+		   "cancel a finished task");
+	unit_check(thread_task_join(t, &result) == 0 && counter == 4,
+		   "the finished task is not affected");
+	struct thread_task *waiter;
+	unit_fail_if(thread_task_new(&waiter, task_wait_for_cancel_f,
+				     &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, waiter) != 0);
+	while (!thread_task_is_running(waiter))
+		usleep(100);
+	unit_check(thread_task_cancel(waiter) == TPOOL_ERR_TASK_STARTED,
+		   "cancel a running task");
+	unit_check(thread_task_join(waiter, &result) == 0 && result == &arg,
+		   "the running task saw the request");
+	/*
+	 * A task reused in another pool forgets the queue of the deleted
+	 * one.
+	 */
+	struct thread_pool *other;
+	unit_fail_if(thread_pool_new(1, &other) != 0);
+	unit_fail_if(thread_pool_push_task(other, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_pool_delete(other) != 0);
+	unit_fail_if(thread_pool_push_task_after(p, t, 10) != 0);
+	unit_check(thread_task_cancel(t) == 0 &&
+		   thread_task_join(t, &result) == TPOOL_ERR_TASK_CANCELLED &&
+		   counter == 5, "cancel a task reused after its pool");
+
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_task_delete(waiter) != 0);
+	unit_fail_if(thread_task_delete(parent) != 0);
+	unit_fail_if(thread_task_delete(child) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_groups(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	struct thread_task_group *g;
+	struct thread_task *t;
+	void *result;
+	unit_fail_if(thread_task_group_new(&g, false) != 0);
+	unit_check(thread_task_group_wait_all(g, 0) == 0, "wait for no tasks");
+	unit_check(thread_task_group_wait_any(g, &t) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "wait for any of no tasks");
+	int arg = 0;
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_task_group_add(g, t) != 0);
+	unit_check(thread_task_group_add(g, t) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "add twice");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(thread_task_group_wait_all(g, 0) == 0,
+		   "a deleted task leaves the group");
+	/*
+	 * Members are handed out only when all of them are finished.
+	 */
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_group_add(g, t) == TPOOL_ERR_TASK_IN_POOL,
+		   "add a pushed task");
+	enum { count = 1000 };
+	struct thread_task *tasks[count];
+	int counter = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+					     &counter) != 0);
+		unit_fail_if(thread_task_group_add(g, tasks[i]) != 0);
+	}
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_task_group_add(g, blocker) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	unit_check(thread_task_group_wait_all(g, 0.01) == TPOOL_ERR_TIMEOUT,
+		   "wait all timed out");
+	unit_check(thread_task_join(blocker, &result) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't join a member");
+	unit_check(thread_task_group_delete(g) == TPOOL_ERR_HAS_TASKS,
+		   "can't delete a busy group");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_check(thread_task_group_wait_all(g, 1e10) == 0, "wait all");
+	unit_check(counter == count, "all the members ran");
+	unit_check(thread_task_join(blocker, &result) == 0 && result == &arg,
+		   "join a handed out member");
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	enum { any_count = 3 };
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		if (i >= any_count)
+			unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	/*
+	 * Any finished member is handed out, each one once.
+	 */
+	for (int i = 0; i < any_count; ++i) {
+		unit_fail_if(thread_task_group_add(g, tasks[i]) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	int seen = 0;
+	for (int i = 0; i < any_count; ++i) {
+		unit_fail_if(thread_task_group_wait_any(g, &t) != 0);
+		for (int j = 0; j < any_count; ++j) {
+			if (tasks[j] == t)
+				seen |= 1 << j;
+		}
+		unit_fail_if(thread_task_join(t, &result) != 0);
+	}
+	unit_check(seen == (1 << any_count) - 1, "wait any");
+	unit_check(thread_task_group_wait_any(g, &t) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "all handed out");
+	unit_check(thread_task_group_delete(g) == 0, "delete a group");
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	for (int i = 0; i < any_count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	/*
+	 * A group deleting its members.
+	 */
+	unit_fail_if(thread_task_group_new(&g, true) != 0);
+	counter = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_pool_task_new(p, &t, task_incr_f,
+						  &counter) != 0);
+		unit_fail_if(thread_task_group_add(g, t) != 0);
+		unit_fail_if(thread_task_detach(t) != TPOOL_ERR_TASK_IN_POOL);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+	}
+	unit_check(thread_task_group_wait_all(g, 1e10) == 0 &&
+		   counter == count, "wait all of auto-deleted members");
+	unit_check(thread_task_group_wait_any(g, &t) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no wait any with auto-delete");
+	unit_fail_if(thread_task_group_delete(g) != 0);
+	unit_check(thread_pool_delete(p) == 0, "members are deleted");
+
+	unit_test_finish();
+}
+
+static double
+monotonic_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	int counter = 0;
+	void *result;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &counter) != 0);
+	unit_check(thread_pool_push_task_after(p, t, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative delay");
+	unit_check(thread_pool_push_task_every(p, t, 0) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "zero period");
+	/*
+	 * Delays below and above the span of the lowest wheel level.
+	 */
+	const double delays[] = {0.02, 0.3};
+	for (int i = 0; i < 2; ++i) {
+		double start = monotonic_sec();
+		unit_fail_if(thread_pool_push_task_after(p, t, delays[i]) != 0);
+		unit_fail_if(thread_task_is_finished(t));
+		unit_fail_if(thread_task_join(t, &result) != 0);
+		double elapsed = monotonic_sec() - start;
+		unit_check(elapsed >= delays[i] && elapsed < delays[i] + 0.5,
+			   "delayed task runs on time");
+	}
+	unit_check(counter == 2, "delayed tasks ran once");
+	/*
+	 * Due tasks are queued in the order of their time.
+	 */
+	enum { count = 3 };
+	struct order_log log = { .next = 0 };
+	struct order_arg args[count];
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i) {
+		args[i].log = &log;
+		args[i].id = count - 1 - i;
+		unit_fail_if(thread_task_new(&tasks[i], task_log_order_f,
+					     &args[i]) != 0);
+		unit_fail_if(thread_pool_push_task_after(p, tasks[i],
+				0.01 + 0.03 * args[i].id) != 0);
+	}
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_check(log.ids[0] == 0 && log.ids[1] == 1 && log.ids[2] == 2,
+		   "delayed tasks run in order");
+	/*
+	 * A cancelled task does not wait for its time.
+	 */
+	unit_fail_if(thread_pool_push_task_after(p, t, 3600) != 0);
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "delayed task is in the pool");
+	unit_check(thread_task_cancel(t) == 0 &&
+		   thread_task_join(t, &result) == TPOOL_ERR_TASK_CANCELLED,
+		   "cancel a delayed task");
+	/* The same with a predecessor, which still has to release it */
+	int gate = 0;
+	struct thread_task *parent;
+	unit_fail_if(thread_task_new(&parent, task_wait_for_f, &gate) != 0);
+	unit_fail_if(thread_pool_push_task(p, parent) != 0);
+	unit_fail_if(thread_task_then(parent, t) != 0);
+	unit_fail_if(thread_pool_push_task_after(p, t, 1) != 0);
+	unit_check(thread_task_cancel(t) == 0 && !thread_task_is_finished(t),
+		   "cancelled delayed task waits for its predecessor");
+	__atomic_store_n(&gate, 1, __ATOMIC_RELAXED);
+	unit_check(thread_task_join(t, &result) == TPOOL_ERR_TASK_CANCELLED,
+		   "join a cancelled delayed successor");
+	unit_fail_if(thread_task_join(parent, &result) != 0);
+	unit_fail_if(thread_task_delete(parent) != 0);
+	unit_check(thread_pool_wait_idle(p, 1) == 0 && counter == 2,
+		   "the successor is not run or queued again");
+	/*
+	 * A periodic task runs until cancelled.
+	 */
+	counter = 0;
+	unit_fail_if(thread_pool_push_task_every(p, t, 0.005) != 0);
+	while (__atomic_load_n(&counter, __ATOMIC_RELAXED) < 5)
+		usleep(1000);
+	int rc = thread_task_cancel(t);
+	unit_check(rc == 0 || rc == TPOOL_ERR_TASK_STARTED,
+		   "cancel a periodic task");
+	unit_check(thread_task_join(t, &result) == 0 && result == &counter,
+		   "join a periodic task with the last result");
+	int runs = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+	usleep(20000);
+	unit_check(counter == runs, "no runs after the cancel");
+	unit_fail_if(thread_pool_push_task_every(p, t, 10) != 0);
+	unit_check(thread_task_cancel(t) == 0 &&
+		   thread_task_join(t, &result) == 0 && result == NULL &&
+		   counter == runs, "join a periodic task cancelled before a run");
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct blocked_producer {
+	struct thread_pool *pool;
+	struct thread_task *task;
+	struct order_arg arg;
+	int rc;
+};
+
+static void *
+blocked_producer_f(void *arg)
+{
+	struct blocked_producer *bp = arg;
+	bp->rc = thread_pool_push_task_wait(bp->pool, bp->task, 1e10);
+	task_log_order_f(&bp->arg);
+	return NULL;
+}
+
+static void
+test_push_wait(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int arg = 0;
+	struct thread_task **tasks = malloc(sizeof(*tasks) * TPOOL_MAX_TASKS);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		unit_fail_if(thread_pool_task_new(p, &tasks[i], task_wait_for_f,
+						  &arg) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, TPOOL_MAX_TASKS) != 0);
+	/*
+	 * A full pool makes the producer wait.
+	 */
+	struct thread_task *t;
+	void *result;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task(p, t) == TPOOL_ERR_TOO_MANY_TASKS,
+		   "pool is full");
+	double start = monotonic_sec();
+	unit_check(thread_pool_push_task_wait(p, t, 0.05) ==
+		   TPOOL_ERR_TIMEOUT, "push wait timed out");
+	double elapsed = monotonic_sec() - start;
+	unit_check(elapsed >= 0.05 && elapsed < 1, "push wait took timeout");
+	unit_check(thread_pool_push_task_wait(p, t, 0) == TPOOL_ERR_TIMEOUT,
+		   "zero timeout does not wait");
+	/*
+	 * Blocked producers get the freed places in the order they came.
+	 */
+	enum { count = 3 };
+	struct order_log log = { .next = 0 };
+	struct blocked_producer producers[count];
+	pthread_t threads[count];
+	for (int i = 0; i < count; ++i) {
+		producers[i].pool = p;
+		producers[i].arg.log = &log;
+		producers[i].arg.id = i;
+		unit_fail_if(thread_task_new(&producers[i].task, task_incr_f,
+					     &arg) != 0);
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    blocked_producer_f,
+					    &producers[i]) != 0);
+		usleep(50000);
+	}
+	unit_check(__atomic_load_n(&log.next, __ATOMIC_RELAXED) == 0,
+		   "producers are blocked");
+	int next_cancel = TPOOL_MAX_TASKS - 1;
+	for (int i = 0; i < count; ++i) {
+		/* The only worker is busy, the rest are in the queue */
+		while (thread_task_cancel(tasks[next_cancel]) != 0)
+			--next_cancel;
+		--next_cancel;
+		while (__atomic_load_n(&log.next, __ATOMIC_RELAXED) != i + 1)
+			usleep(1000);
+	}
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i)
+		is_ok = is_ok && producers[i].rc == 0 && log.ids[i] == i;
+	unit_check(is_ok, "producers are woken up in order");
+
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i) {
+		int rc = thread_task_join(tasks[i], &result);
+		unit_fail_if(rc != 0 && rc != TPOOL_ERR_TASK_CANCELLED);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(producers[i].task, &result) != 0);
+		unit_fail_if(thread_task_delete(producers[i].task) != 0);
+	}
+	unit_check(thread_pool_push_task_wait(p, t, 1) == 0 &&
+		   thread_task_join(t, &result) == 0, "push wait with room");
+	unit_fail_if(thread_task_delete(t) != 0);
+	free(tasks);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_wait_idle_f(void *arg)
+{
+	return (void *)(intptr_t)thread_pool_wait_idle(arg, 1);
+}
+
+static void
+test_wait_idle(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_check(thread_pool_wait_idle(p, 0) == 0, "new pool is idle");
+	/*
+	 * A running task keeps the pool busy.
+	 */
+	int arg = 0;
+	void *result;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	double start = monotonic_sec();
+	unit_check(thread_pool_wait_idle(p, 0.05) == TPOOL_ERR_TIMEOUT,
+		   "wait idle timed out");
+	double elapsed = monotonic_sec() - start;
+	unit_check(elapsed >= 0.05 && elapsed < 1, "wait idle took timeout");
+	unit_check(thread_pool_delete_wait(p, 0) == TPOOL_ERR_TIMEOUT,
+		   "busy pool is not deleted");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_check(thread_pool_wait_idle(p, 10) == 0, "pool is idle");
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	/*
+	 * Detached tasks need no joins, the wait is the only way to know
+	 * they are all done.
+	 */
+	enum { count = 1000 };
+	int counter = 0;
+	for (int i = 0; i < count; ++i) {
+		struct thread_task *t;
+		unit_fail_if(thread_task_new(&t, task_incr_f, &counter) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_detach(t) != 0);
+	}
+	unit_check(thread_pool_wait_idle(p, 10) == 0 &&
+		   __atomic_load_n(&counter, __ATOMIC_RELAXED) == count,
+		   "all the detached tasks are done");
+	/* A task can not wait for its own pool */
+	struct thread_task *waiter;
+	unit_fail_if(thread_task_new(&waiter, task_wait_idle_f, p) != 0);
+	unit_fail_if(thread_pool_push_task(p, waiter) != 0);
+	unit_check(thread_task_join(waiter, &result) == 0 &&
+		   (intptr_t)result == TPOOL_ERR_INVALID_ARGUMENT,
+		   "wait idle inside a task");
+	unit_fail_if(thread_task_delete(waiter) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * The delete drains the pool first, detached tasks from its cache
+	 * are back there by then.
+	 */
+	bool is_ok = true;
+	for (int round = 0; round < 100; ++round) {
+		unit_fail_if(thread_pool_new(4, &p) != 0);
+		counter = 0;
+		for (int i = 0; i < 200; ++i) {
+			struct thread_task *t;
+			unit_fail_if(thread_pool_task_new(p, &t, task_incr_f,
+							  &counter) != 0);
+			unit_fail_if(thread_pool_push_task(p, t) != 0);
+			unit_fail_if(thread_task_detach(t) != 0);
+		}
+		is_ok = is_ok && thread_pool_delete_wait(p, 10) == 0 &&
+			__atomic_load_n(&counter, __ATOMIC_RELAXED) == 200;
+		if (!is_ok)
+			break;
+	}
+	unit_check(is_ok, "pool is drained and deleted");
+
+	unit_test_finish();
+}
+
+static void
+test_completions(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	void *result;
+	int counter = 0;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	unit_check(thread_pool_completion_fd(p) == -1 &&
+		   thread_pool_reap_completed(p, &t, 1) == 0,
+		   "no completion queue by default");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	struct thread_pool_options opts;
+	thread_pool_options_init(&opts);
+	opts.max_thread_count = 4;
+	opts.completion_queue = true;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	int fd = thread_pool_completion_fd(p);
+	unit_check(fd >= 0, "completion fd");
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	unit_check(poll(&pfd, 1, 0) == 0, "nothing to reap");
+	/*
+	 * Finished tasks are reaped in batches when the fd is readable.
+	 */
+	enum { count = 100, batch = 16 };
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+					     &counter) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_check(thread_task_join(tasks[0], &result) ==
+		   TPOOL_ERR_TASK_IN_POOL, "no join before reap");
+#if NEED_DETACH
+	unit_check(thread_task_detach(tasks[0]) == TPOOL_ERR_TASK_IN_POOL,
+		   "no detach before reap");
+#endif
+	int reaped = 0;
+	bool is_ok = true;
+	while (reaped < count) {
+		unit_fail_if(poll(&pfd, 1, 10000) != 1);
+		struct thread_task *done[batch];
+		int n = thread_pool_reap_completed(p, done, batch);
+		for (int i = 0; i < n; ++i) {
+			is_ok = is_ok && thread_task_is_finished(done[i]) &&
+				thread_task_join(done[i], &result) == 0 &&
+				result == &counter;
+		}
+		reaped += n;
+	}
+	unit_check(is_ok && reaped == count && counter == count,
+		   "all the tasks are reaped and joined");
+	unit_check(thread_pool_reap_completed(p, tasks, count) == 0,
+		   "completion queue is empty");
+	/*
+	 * The fd stays readable while some tasks are left.
+	 */
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	for (int i = 0; i < 3; ++i) {
+		while (!thread_task_is_finished(tasks[i]))
+			usleep(100);
+	}
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "not reaped tasks are in the pool");
+	/* All the finished tasks are in the queue after the failed delete */
+	reaped = 0;
+	for (int i = 0; i < 3; ++i) {
+		is_ok = is_ok && poll(&pfd, 1, 0) == 1;
+		reaped += thread_pool_reap_completed(p, &t, 1);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+	}
+	unit_check(is_ok && reaped == 3 && poll(&pfd, 1, 0) == 0,
+		   "reap the rest one by one");
+	/*
+	 * The pieces of a parallel loop are joined by the loop, they never
+	 * show up in the completion queue.
+	 */
+	enum { loop_size = 100000 };
+	char *marks = calloc(loop_size, 1);
+	unit_check(thread_pool_parallel_for(p, 0, loop_size, 10, loop_mark_f,
+					    marks) == 0 &&
+		   marks_are(marks, loop_size, 1) &&
+		   poll(&pfd, 1, 0) == 0 &&
+		   thread_pool_reap_completed(p, &t, 1) == 0,
+		   "parallel loop in a completion queue pool");
+	free(marks);
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_get_cpu_f(void *arg)
+{
+	(void)arg;
+	return (void *)(intptr_t)sched_getcpu();
+}
+
+static void
+test_affinity(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_options opts;
+	thread_pool_options_init(&opts);
+	opts.max_thread_count = 2;
+	opts.affinity = TPOOL_AFFINITY_ROUND_ROBIN + 1;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "unknown affinity");
+	int bad_cpus[] = {-1};
+	opts.affinity = TPOOL_AFFINITY_COMPACT;
+	opts.cpus = bad_cpus;
+	opts.cpu_count = 1;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "bad CPU");
+	/* More CPUs than there can be */
+	static int many_cpus[CPU_SETSIZE + 1];
+	opts.cpus = many_cpus;
+	opts.cpu_count = CPU_SETSIZE + 1;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "too many CPUs");
+	opts.cpu_count = 1;
+	/*
+	 * Workers pinned to one CPU run only there.
+	 */
+	cpu_set_t allowed;
+	unit_fail_if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0);
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &allowed))
+		++cpu;
+	int twice[] = {cpu, cpu};
+	opts.cpus = twice;
+	opts.cpu_count = 2;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "repeated CPU");
+	opts.cpu_count = 1;
+	opts.cpus = &cpu;
+	unit_check(thread_pool_new_ex(&opts, &p) == 0, "pinned pool");
+	struct thread_task *tasks[10];
+	for (int i = 0; i < 10; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_get_cpu_f,
+					     NULL) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	bool is_pinned = true;
+	for (int i = 0; i < 10; ++i) {
+		void *result;
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		is_pinned = is_pinned && (intptr_t)result == cpu;
+	}
+	unit_check(is_pinned, "tasks run on the given CPU");
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Workers spread over all the CPUs.
+	 */
+	opts.affinity = TPOOL_AFFINITY_ROUND_ROBIN;
+	opts.cpus = NULL;
+	opts.cpu_count = 0;
+	opts.max_thread_count = 4;
+	unit_check(thread_pool_new_ex(&opts, &p) == 0, "round-robin pool");
+	for (int i = 0; i < 10; ++i)
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	bool is_allowed = true;
+	for (int i = 0; i < 10; ++i) {
+		void *result;
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		is_allowed = is_allowed && CPU_ISSET((intptr_t)result, &allowed);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(is_allowed, "tasks run on the allowed CPUs");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+/* The sanitizers grow the thread stacks and map their shadow memory */
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define IS_SANITIZED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define IS_SANITIZED 1
+#endif
+#endif
+#ifndef IS_SANITIZED
+#define IS_SANITIZED 0
+#endif
+
+struct thread_attr_info {
+	size_t stack_size;
+	size_t guard_size;
+	char name[16];
+};
+
+static void *
+task_thread_attr_f(void *arg)
+{
+	struct thread_attr_info *info = arg;
+	pthread_attr_t attr;
+	unit_fail_if(pthread_getattr_np(pthread_self(), &attr) != 0);
+	pthread_attr_getstacksize(&attr, &info->stack_size);
+	pthread_attr_getguardsize(&attr, &info->guard_size);
+	pthread_attr_destroy(&attr);
+	pthread_getname_np(pthread_self(), info->name, sizeof(info->name));
+	return arg;
+}
+
+/* A memory size of the process in KB, like VmSize or VmRSS */
+static long
+proc_status_kb(const char *field)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	unit_fail_if(f == NULL);
+	char line[256];
+	long size = -1;
+	size_t len = strlen(field);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, field, len) == 0 && line[len] == ':' &&
+		    sscanf(line + len + 1, "%ld kB", &size) == 1)
+			break;
+	}
+	fclose(f);
+	return size;
+}
+
+static void
+test_thread_attrs(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options options;
+	thread_pool_options_init(&options);
+	struct thread_pool *p;
+	options.stack_size = 1024;
+	unit_check(thread_pool_new_ex(&options, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too small stack");
+	/*
+	 * The workers get the stack, the guard and the name.
+	 */
+	enum { count = 8 };
+	const size_t stack_size = 128 * 1024;
+	const size_t guard_size = 64 * 1024;
+	options.max_thread_count = count;
+	options.stack_size = stack_size;
+	options.guard_size = guard_size;
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+	struct thread_attr_info info;
+	struct thread_task *t;
+	void *result;
+	unit_fail_if(thread_task_new(&t, task_thread_attr_f, &info) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	/* Not joined right away, so as not to run it in this thread */
+	while (!thread_task_is_finished(t))
+		usleep(100);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(IS_SANITIZED || info.stack_size == stack_size,
+		   "worker stack size");
+	unit_check(info.guard_size == guard_size, "worker guard size");
+	unit_check(strncmp(info.name, "tpool-", 6) == 0, "worker name");
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Each worker takes about its stack and guard of the address
+	 * space, not the default 8 MB.
+	 */
+	options.guard_size = 0;
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+	int arg = 0;
+	struct thread_task *tasks[count];
+	long before = proc_status_kb("VmSize");
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	for (int i = 0; i < count; ++i) {
+		while (!thread_task_is_running(tasks[i]))
+			usleep(100);
+	}
+	long per_worker = (proc_status_kb("VmSize") - before) / count;
+	unit_msg("%ld KB per worker", per_worker);
+	unit_check(thread_pool_thread_count(p) == count &&
+		   (IS_SANITIZED ||
+		    per_worker <= (long)(stack_size / 1024) + 64),
+		   "small worker footprint");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * The queues of an empty pool take no memory until they are used.
+	 * Several pools at once, so the freed memory of the previous ones
+	 * does not hide it.
+	 */
+	enum { pool_count = 16 };
+	struct thread_pool *pools[pool_count];
+	before = proc_status_kb("VmRSS");
+	for (int i = 0; i < pool_count; ++i)
+		unit_fail_if(thread_pool_new(count, &pools[i]) != 0);
+	long pool_rss = (proc_status_kb("VmRSS") - before) / pool_count;
+	unit_msg("%ld KB per empty pool", pool_rss);
+	unit_check(IS_SANITIZED || pool_rss < 1024, "small empty pool");
+	for (int i = 0; i < pool_count; ++i)
+		unit_fail_if(thread_pool_delete(pools[i]) != 0);
+
+	unit_test_finish();
+}
+
+static uint64_t
+hist_sum(const uint64_t *hist)
+{
+	uint64_t sum = 0;
+	for (int i = 0; i < TPOOL_STATS_BUCKETS; ++i)
+		sum += hist[i];
+	return sum;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_stats stats;
+	struct thread_pool_options opts;
+	thread_pool_options_init(&opts);
+	opts.max_thread_count = 1;
+	opts.idle_timeout = 0.05;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	thread_pool_get_stats(p, &stats);
+	unit_check(stats.tasks_pushed == 0 && stats.tasks_completed == 0 &&
+		   stats.workers_created == 0 && stats.queue_depth == 0,
+		   "empty stats");
+	/*
+	 * The queue grows behind a busy worker.
+	 */
+	int arg = 0;
+	void *result;
+	struct thread_task *blocker;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	enum { count = 10 };
+	struct thread_task *tasks[count];
+	int counter = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+					     &counter) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	thread_pool_get_stats(p, &stats);
+	unit_check(stats.queue_depth == count, "queue depth");
+	unit_check(stats.tasks_pushed == count + 1 &&
+		   stats.tasks_completed == 0, "pushed tasks");
+	/* A cancelled task is pushed, but does not complete */
+	struct thread_task *cancelled;
+	unit_fail_if(thread_task_new(&cancelled, task_incr_f, &counter) != 0);
+	unit_fail_if(thread_pool_push_task(p, cancelled) != 0);
+	unit_fail_if(thread_task_cancel(cancelled) != 0);
+	thread_pool_get_stats(p, &stats);
+	unit_check(stats.tasks_pushed == count + 2 &&
+		   stats.tasks_cancelled == 1 && stats.tasks_completed == 0,
+		   "cancelled tasks");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	thread_pool_get_stats(p, &stats);
+	unit_check(stats.tasks_pushed == count + 2 &&
+		   stats.tasks_completed == count + 1 &&
+		   stats.tasks_cancelled == 1, "completed tasks");
+	unit_check(stats.queue_depth == 0 && stats.peak_queue_depth == count + 1,
+		   "peak queue depth");
+	unit_check(hist_sum(stats.wait_time_hist) == count + 2 &&
+		   hist_sum(stats.run_time_hist) == count + 2,
+		   "each task is in the histograms");
+	int bucket = 0;
+	while (stats.run_time_hist[bucket] == 0)
+		++bucket;
+	unit_check(bucket < 20, "fast tasks are in the low buckets");
+	/*
+	 * Worker life cycle.
+	 */
+	while (thread_pool_thread_count(p) != 0)
+		usleep(1000);
+	thread_pool_get_stats(p, &stats);
+	unit_check(stats.workers_created == 1 && stats.workers_retired == 1,
+		   "created and retired workers");
+	unit_fail_if(thread_task_join(cancelled, &result) !=
+		     TPOOL_ERR_TASK_CANCELLED);
+	unit_fail_if(thread_task_delete(cancelled) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static int
+count_substr(const char *text, const char *pattern)
+{
+	int count = 0;
+	for (const char *pos = strstr(text, pattern); pos != NULL;
+	     pos = strstr(pos + 1, pattern))
+		++count;
+	return count;
+}
+
+static char *
+read_file(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *text = malloc(size + 1);
+	text[fread(text, 1, size, file)] = 0;
+	fclose(file);
+	return text;
+}
+
+static void
+test_trace(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	const char *path = "trace_test.json";
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	unit_check(thread_pool_trace_dump(p, path) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no trace without tracing");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	struct thread_pool_options opts;
+	thread_pool_options_init(&opts);
+	opts.max_thread_count = 2;
+	opts.trace_size = -1;
+	unit_check(thread_pool_new_ex(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "negative trace size");
+	opts.trace_size = 1024;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	enum { count = 50 };
+	struct thread_task *tasks[count];
+	int arg = 0;
+	void *result;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_check(thread_pool_trace_dump(p, "/nonexistent/trace.json") ==
+		   TPOOL_ERR_IO, "bad path");
+	unit_check(thread_pool_trace_dump(p, path) == 0, "dumped");
+	char *text = read_file(path);
+	unit_fail_if(text == NULL);
+	unit_check(strncmp(text, "{\"traceEvents\":[", 15) == 0 &&
+		   strstr(text, "]") != NULL, "trace format");
+	unit_check(count_substr(text, "\"name\":\"push\"") == count,
+		   "all the pushes are traced");
+	unit_check(count_substr(text, "\"name\":\"task\",\"ph\":\"B\"") ==
+		   count && count_substr(text, "\"name\":\"task\",\"ph\":\"E\"") ==
+		   count, "all the runs are traced");
+	unit_check(count_substr(text, "\"name\":\"external\"") == 1 &&
+		   count_substr(text, "\"name\":\"worker 1\"") == 1,
+		   "threads are named");
+	free(text);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * A small trace keeps only the latest events.
+	 */
+	opts.trace_size = 4;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	/* The joins would trace the tasks they run in the pushes' ring */
+	for (int i = 0; i < count; ++i) {
+		while (!thread_task_is_finished(tasks[i]))
+			usleep(100);
+	}
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_trace_dump(p, path) != 0);
+	text = read_file(path);
+	unit_check(count_substr(text, "\"name\":\"push\"") == 4,
+		   "old events are overwritten");
+	free(text);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * A task suspended on its fiber ends its run in the trace and
+	 * starts a new one when resumed, so the runs stay nested.
+	 */
+	opts.max_thread_count = 1;
+	opts.trace_size = 1024;
+	opts.fiber_stack_size = 64 * 1024;
+	unit_fail_if(thread_pool_new_ex(&opts, &p) != 0);
+	struct thread_task *gate, *child, *waiter;
+	int started = 0;
+	unit_fail_if(thread_task_new(&gate, task_return_arg_f, NULL) != 0);
+	unit_fail_if(thread_task_new(&child, task_return_arg_f, NULL) != 0);
+	struct fiber_waiter_arg wa = { .child = child, .started = &started };
+	unit_fail_if(thread_task_new(&waiter, task_fiber_waiter_f, &wa) != 0);
+	unit_fail_if(thread_task_then(gate, child) != 0);
+	unit_fail_if(thread_pool_push_task(p, child) != 0);
+	unit_fail_if(thread_pool_push_task(p, waiter) != 0);
+	do {
+		usleep(1000);
+		unit_fail_if(thread_pool_trace_dump(p, path) != 0);
+		text = read_file(path);
+		bool is_suspended = strstr(text, "\"suspended\"") != NULL;
+		free(text);
+		if (is_suspended)
+			break;
+	} while (true);
+	unit_fail_if(thread_pool_push_task(p, gate) != 0);
+	unit_fail_if(thread_task_join(waiter, &result) != 0);
+	unit_fail_if(thread_pool_trace_dump(p, path) != 0);
+	text = read_file(path);
+	unit_check(count_substr(text, "\"name\":\"task\",\"ph\":\"B\"") ==
+		   4 && count_substr(text, "\"name\":\"task\",\"ph\":\"E\"") ==
+		   4 && count_substr(text, "\"suspended\":true") == 1 &&
+		   count_substr(text, "\"resumed\":true") == 1,
+		   "suspended runs are closed and resumed");
+	free(text);
+	/* The waiter has joined the child */
+	unit_fail_if(thread_task_join(gate, &result) != 0);
+	unit_fail_if(thread_task_delete(gate) != 0);
+	unit_fail_if(thread_task_delete(child) != 0);
+	unit_fail_if(thread_task_delete(waiter) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	remove(path);
+
+	unit_test_finish();
+}
+
 static void
 test_timed_join(void)
 {
@@ -383,6 +2406,28 @@ main(int argc, char **argv)
 	test_push();
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
+	test_push_many_producers();
+	test_push_batch();
+	test_task_cache();
+	test_inline_tasks();
+	test_task_state();
+	test_idle_workers();
+	test_idle_timeout();
+	test_priorities();
+	test_continuations();
+	test_parallel_for();
+	test_join_help();
+	test_fibers();
+	test_cancel();
+	test_groups();
+	test_timers();
+	test_push_wait();
+	test_wait_idle();
+	test_completions();
+	test_affinity();
+	test_thread_attrs();
+	test_stats();
+	test_trace();
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
@@ -3,177 +3,3475 @@
 #include "thread_pool.h"
 #include <pthread.h>
 
-#include <stdlib.h>
-// temp
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#if defined(__SANITIZE_THREAD__)
+#include <sanitizer/tsan_interface.h>
+#endif
+
+enum {
+   CACHE_LINE_SIZE = 64,
+   /* Room for "-" and a worker number in the 15 chars of a thread name */
+   THREAD_NAME_PREFIX_MAX = 10,
+};
+
+/*
+ * Starts a new cache line in a structure. Fields written by different
+ * threads are kept apart, so that a write does not evict the line from
+ * the caches of the cores which only read the neighbouring fields.
+ */
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/*
+ * Task life cycle. The state lives in the low bits of one atomic word
+ * together with the flags below, so a single load tells everything a
+ * joiner needs and a finished task can be joined without any locks.
+ */
+enum thread_task_state {
+   /* Not pushed, or already joined */
+   TASK_STATE_NEW = 0,
+   TASK_STATE_QUEUED,
+   TASK_STATE_RUNNING,
+   TASK_STATE_FINISHED,
+   TASK_STATE_MASK = 0xff,
+   /* Someone sleeps on the futex waiting for the task to finish */
+   TASK_FLAG_WAITERS = 1 << 8,
+   /* Delete the task right when it is finished */
+   TASK_FLAG_DETACHED = 1 << 9,
+   /* The owner does not need the task anymore */
+   TASK_FLAG_CANCEL_REQUESTED = 1 << 10,
+   /* The task was finished without being run */
+   TASK_FLAG_CANCELLED = 1 << 11,
+   /* The task goes to the pool's completion queue and waits to be reaped */
+   TASK_FLAG_COMPLETION = 1 << 12,
+};
+
+/* Link from a task to one of the tasks waiting for it to finish */
+struct task_edge {
+   struct thread_task *task;
+   struct task_edge *next;
+};
+
+/* Successors list of a finished task, no more edges can be added */
+#define TASK_EDGES_CLOSED ((struct task_edge *)1)
+
+struct thread_task {
+	thread_task_f function;
+	void *arg;
+
+	/* PUT HERE OTHER MEMBERS */
+   /* The first line is set on creation and push, then only read */
+   /* enum thread_task_priority, picks the queues the task goes to */
+   int priority;
+   /* Pool the task is pushed to, where its predecessors release it */
+   struct thread_pool *pool;
+   /* Slab the task was taken from, NULL for the tasks made by malloc */
+   struct task_slab *slab;
+   /* Group the task belongs to until the group hands it out */
+   struct thread_task_group *group;
+   /* Period of a periodic task */
+   uint64_t period;
+   /* A piece of a parallel loop, never reported by the completion queue */
+   bool is_internal;
+
+   /* The completion side, written by the joiners and predecessors too */
+   /* enum thread_task_state with flags, also used as a futex */
+   uint32_t state CACHE_ALIGNED;
+   /* Unfinished predecessors, plus one until the task is pushed */
+   int pending;
+   /* Lock-free stack of edges to the tasks waiting for this one */
+   struct task_edge *successors;
+   void *result;
+   /* Next one in the stack of finished group members or completions */
+   struct thread_task *group_next;
+   /* Fiber the task runs on, NULL when it runs on a thread's stack */
+   struct task_fiber *fiber;
+
+   /* The queue side, written by whoever links or unlinks the task */
+   struct thread_task *next CACHE_ALIGNED;
+   struct thread_task *prev;
+   /* Deque the task is linked into, NULL when it is not in a deque */
+   struct task_deque *deque;
+   /* Ring cell the task was last put into, a joiner can take it back */
+   struct task_ring_cell *ring_cell;
+   /* When the task was queued, for the wait time statistics */
+   uint64_t queued_at;
+   /* When a delayed task is due */
+   uint64_t due_at;
+   /* Head of the timer wheel slot the task is in, NULL when it is not */
+   struct thread_task **timer_slot;
+
+   /* Copy of the argument of an inline task, the function writes there */
+   unsigned char payload[TPOOL_TASK_INLINE_SIZE] CACHE_ALIGNED;
+};
+
+enum {
+   /* Someone sleeps on the group's counter waiting for it to reach 0 */
+   GROUP_FLAG_WAITERS = 1u << 31,
+   /* The same waiting for any change, thread_task_group_wait_any() */
+   GROUP_FLAG_ANY_WAITERS = 1u << 30,
+   GROUP_FLAGS = GROUP_FLAG_WAITERS | GROUP_FLAG_ANY_WAITERS,
+};
+
+/*
+ * Members are counted with a single atomic counter, the thread
+ * finishing the last one does the only wakeup. Finished members are
+ * kept in a lock-free stack until the owner takes them.
+ */
+struct thread_task_group {
+   /* Unfinished members plus GROUP_FLAGS, a futex word */
+   uint32_t unfinished;
+   /* Finished members are deleted instead of being kept */
+   bool is_auto_delete;
+   /* Members finished and not yet taken by a wait */
+   struct thread_task *finished;
+   /* Serializes the waits taking the finished members */
+   pthread_mutex_t mutex;
+   /* Members taken off the stack by a wait, but not yet handed out */
+   struct thread_task *ready;
+};
+
+/*
+ * Per-worker double-ended queue. The owner pushes and pops at the
+ * tail, other workers steal from the head, so the owner keeps working
+ * on the freshest (cache-hot) tasks while thieves take the oldest ones.
+ */
+struct task_deque {
+   /* Thieves lock it, so each deque has a line of its own */
+   pthread_mutex_t mutex CACHE_ALIGNED;
+   struct thread_task *first;
+   struct thread_task *last;
+};
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer queue of tasks, the
+ * algorithm is by Dmitry Vyukov. Each cell has a sequence number telling
+ * for which lap of the ring it is free to write (sequence == position)
+ * or ready to read (sequence == position + 1). Producers and consumers
+ * claim positions with a CAS on their own cursor and never block each
+ * other. A joiner can take its task out of a cell leaving NULL there,
+ * such cells are skipped. A cell keeps its sequence minus its index, so
+ * the zeroed memory is a ready ring and the pages of a big ring are not
+ * touched before the queue gets that deep.
+ */
+struct task_ring_cell {
+   size_t sequence;
+   struct thread_task *task;
+};
+
+struct task_ring {
+   struct task_ring_cell *cells;
+   size_t mask;
+   /* Producers and consumers do not contend for the same line */
+   size_t enqueue_pos CACHE_ALIGNED;
+   size_t dequeue_pos CACHE_ALIGNED;
+};
+
+enum {
+   TASK_SLAB_CHUNK_SIZE = 64,
+};
+
+struct task_slab_chunk {
+   struct task_slab_chunk *next;
+   struct thread_task tasks[TASK_SLAB_CHUNK_SIZE];
+};
+
+/*
+ * Cache of task objects owned by a pool. Tasks are carved from chunks
+ * allocated in one go, so reusing a task does not touch the heap.
+ */
+struct task_slab {
+   pthread_mutex_t mutex;
+   /* Free tasks linked via their next pointers */
+   struct thread_task *free_list;
+   struct task_slab_chunk *chunks;
+   /* Tasks handed out and not yet returned */
+   int used_count;
+   /* Tasks on the way back finished by the threads outside of the pool */
+   int in_flight;
+   /* How many chunks were allocated */
+   uint64_t alloc_count;
+};
+
+enum {
+   /* Bounds of the adaptive spinning before an idle worker parks */
+   WORKER_SPIN_MIN = 64,
+   WORKER_SPIN_MAX = 4096,
+   /*
+    * Every such pick a worker looks at the levels from the lowest one,
+    * so a stream of urgent tasks can not starve the background ones.
+    */
+   WORKER_STARVATION_PERIOD = 8,
+};
+
+enum worker_park_state {
+   WORKER_AWAKE = 0,
+   WORKER_PARKED,
+};
+
+enum worker_slot_state {
+   /* No thread, the slot can be taken by a new worker */
+   SLOT_FREE = 0,
+   SLOT_ALIVE,
+   /* The thread retired and has to be joined before the slot is reused */
+   SLOT_EXITING,
+};
+
+/*
+ * Statistics collected by a worker. Only the owner writes them, so they
+ * need no atomic read-modify-write, and readers just sum up the workers.
+ */
+struct worker_stats {
+   /* Tasks pushed by the worker, or by the other threads for the helper */
+   uint64_t tasks_pushed;
+   uint64_t tasks_completed;
+   uint64_t tasks_cancelled;
+   /* The deepest queue the worker saw when taking a task */
+   int peak_queue_depth;
+   uint64_t wait_time_hist[TPOOL_STATS_BUCKETS];
+   uint64_t run_time_hist[TPOOL_STATS_BUCKETS];
+};
+
+enum trace_event_type {
+   TRACE_PUSH,
+   TRACE_START,
+   TRACE_FINISH,
+   TRACE_STEAL,
+   TRACE_PARK,
+   TRACE_WAKE,
+   TRACE_SUSPEND,
+   TRACE_RESUME,
+};
+
+struct trace_event {
+   /*
+    * Position + 1 the event was written for, 0 while it is being
+    * written. Lets a reader detect the events overwritten under it.
+    */
+   uint64_t seq;
+   uint64_t time;
+   uintptr_t task;
+   uint32_t type;
+};
+
+/*
+ * Ring of the latest events of a thread, the oldest ones are overwritten.
+ * Writers claim positions with a fetch-add, so the ring of the threads
+ * pushing from outside of the pool is shared by them without locks.
+ */
+struct trace_ring {
+   struct trace_event *events;
+   uint64_t size;
+   uint64_t head;
+};
+
+struct pool_worker {
+   struct thread_pool *pool;
+   pthread_t thread;
+   /* enum worker_slot_state */
+   int slot_state;
+   /* One deque per priority level */
+   struct task_deque deques[TPOOL_PRIORITY_COUNT];
+   /* Tasks taken by the worker, drives the starvation guard */
+   unsigned pick_count;
+   /* CPU the worker is pinned to, -1 if it is not pinned */
+   int cpu;
+   /* Index of the pool's node the worker belongs to */
+   int node;
+   /* State of the xorshift generator picking steal victims */
+   unsigned steal_seed;
+   /* How long to spin for work before parking, adapts to the load */
+   int spin_limit;
+   /* Tasks being run by the worker, more than one when a task joins */
+   int run_depth;
+   /* Fibers ready for new tasks */
+   struct task_fiber *free_fibers;
+   int free_fiber_count;
+   /* Fibers waiting in a join, the worker can not exit until they end */
+   int suspended_count;
+   /* A finished slab task might be on the way back, the deletion waits */
+   int slab_in_flight;
+   struct worker_stats stats;
+   struct trace_ring trace;
+   /* Written by the threads waking the worker up */
+   /* enum worker_park_state, the worker sleeps on it as on a futex */
+   uint32_t park_state CACHE_ALIGNED;
+   /* Next worker in the pool's stack of parked workers */
+   struct pool_worker *next_parked;
+   /* Stack of the suspended fibers whose awaited tasks are finished */
+   struct task_fiber *resumable;
+};
+
+enum {
+   /* Fibers a worker keeps for the next tasks, the rest are unmapped */
+   FIBER_CACHE_SIZE = 16,
+   FIBER_STACK_MIN = 16384,
+};
+
+/*
+ * Execution context of a task which gives its worker to other tasks
+ * while it waits in a join. A fiber is resumed only by the worker which
+ * started it, so the thread-local state stays valid across the switches.
+ */
+struct task_fiber {
+   ucontext_t context;
+   /* Context to switch back to when the fiber suspends or is done */
+   ucontext_t *caller;
+   struct pool_worker *worker;
+   /* Mapping of the stack, its lowest page is a guard */
+   char *stack;
+   size_t stack_size;
+   /* Task being run, NULL while the fiber is free */
+   struct thread_task *task;
+   uint64_t started_at;
+   bool is_done;
+   /* Tasks running on the fiber, its own one and those it runs inline */
+   int run_depth;
+   /* Next one in the worker's cache or stack of resumable fibers */
+   struct task_fiber *next;
+#if defined(__SANITIZE_THREAD__)
+   void *tsan_fiber;
+   void *tsan_caller;
+#endif
+};
+
+/*
+ * Group of the workers pinned to the CPUs of one NUMA node. Tasks pushed
+ * from the node's CPUs stay in its queues, so they are likely to be run
+ * close to the memory they touch.
+ */
+struct pool_node {
+   /* Injection queues for the tasks pushed from outside of the pool */
+   struct task_ring rings[TPOOL_PRIORITY_COUNT];
+};
+
+enum {
+   /*
+    * The timer wheel has levels of slots, each level's slot spans all
+    * the slots of the level below. A task goes to the lowest level which
+    * reaches its due time and is moved down as the time goes by.
+    */
+   TIMER_LEVELS = 4,
+   TIMER_SLOT_BITS = 6,
+   TIMER_SLOTS = 1 << TIMER_SLOT_BITS,
+   TIMER_TICK_NS = 1000000,
+};
+
+/* Delayed and periodic tasks waiting for their time */
+struct timer_wheel {
+   pthread_mutex_t mutex;
+   /* The timer thread sleeps on it until the nearest due tick */
+   pthread_cond_t cond;
+   pthread_t thread;
+   /* The thread is started on the first delayed push */
+   bool is_started;
+   bool is_stopped;
+   /* Time of tick 0 */
+   uint64_t start;
+   /* Next tick to process */
+   uint64_t current_tick;
+   /* Tick the thread is going to wake up at */
+   uint64_t wakeup_tick;
+   int count;
+   struct thread_task *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/*
+ * Finished tasks waiting for an event loop to reap them. Workers push
+ * them onto a lock-free stack and make the eventfd readable when the
+ * stack was empty. The reaper takes the whole stack at once.
+ */
+struct completion_queue {
+   /* -1 when the pool has no completion queue, read by every push */
+   int fd;
+   struct thread_task *finished CACHE_ALIGNED;
+   /* Workers between leaving tasks_count and the eventfd write */
+   int in_flight;
+   /* Serializes the reapers */
+   pthread_mutex_t mutex;
+   /* Tasks taken off the stack, in the order of finish, not handed out */
+   struct thread_task *ready;
+   struct thread_task **ready_tail;
+};
+
+/* Producer blocked until the pool has room for its task */
+struct push_waiter {
+   struct push_waiter *next;
+   /* Set once a task is reserved for the waiter, a futex word */
+   uint32_t is_granted;
+};
+
+struct thread_pool {
+	/* PUT HERE OTHER MEMBERS */
+   /*
+    * The first line is set up on creation and then only read, so all
+    * the threads keep it in their caches.
+    */
+   struct pool_worker *workers;
+   int max_threads_count;
+   /* Seconds a parked worker waits for work before exiting, 0 - forever */
+   double idle_timeout;
+   /* NUMA nodes of the workers, just one when they are not pinned */
+   struct pool_node *nodes;
+   int node_count;
+   /* Index of the pool's node for each CPU, NULL with one node */
+   int *cpu_nodes;
+   /* Tracing is off unless the pool is created with trace_size */
+   bool is_tracing;
+   bool is_shutdown;
+   /* Zero time of the trace */
+   uint64_t trace_start;
+   /* Stack size of the task fibers, 0 if tasks run on the worker stacks */
+   size_t fiber_stack_size;
+   /* Stack and guard sizes of the pool's threads, 0 for the defaults */
+   size_t stack_size;
+   size_t guard_size;
+   /* Prefix of the thread names, empty if the threads are not named */
+   char thread_name[THREAD_NAME_PREFIX_MAX + 1];
+
+   /* The push side, the counters every push reserves room in */
+   /* Pushed and not yet finished tasks, including the running ones */
+   int tasks_count CACHE_ALIGNED;
+   /* Producers blocked in thread_pool_push_task_wait() */
+   int push_waiter_count;
+   /* Threads in thread_pool_wait_idle(), sleeping on tasks_count */
+   int idle_waiter_count;
+   /* Threads outside of the pool in thread_pool_unreserve() */
+   int unreserving_count;
+   /* Round-robin cursor picking a deque for batches pushed from outside */
+   unsigned next_deque;
+
+   /* The worker side, updated when the tasks are queued and taken */
+   /* Tasks sitting in the queues and not yet picked by any worker */
+   int queued_count CACHE_ALIGNED;
+   /* The same per priority level */
+   int queued_counts[TPOOL_PRIORITY_COUNT];
+   /* Workers which are not running a task right now */
+   int idle_threads;
+
+   /*
+    * Stack of parked workers. The most recently parked worker is woken
+    * first as its caches are the warmest.
+    */
+   pthread_mutex_t park_mutex CACHE_ALIGNED;
+   struct pool_worker *parked;
+   int parked_count;
+
+   pthread_mutex_t spawn_mutex CACHE_ALIGNED;
+   /* Number of live workers */
+   int active_threads;
+   /* Threads ever started and exited on idle timeout */
+   uint64_t workers_created;
+   uint64_t workers_retired;
+
+   /*
+    * Tasks run by the joining threads not belonging to the pool. They
+    * are many writers, so here the counters are updated atomically.
+    */
+   struct worker_stats helper_stats CACHE_ALIGNED;
+   /* Events of the threads not belonging to the pool */
+   struct trace_ring trace CACHE_ALIGNED;
+   struct task_slab slab CACHE_ALIGNED;
+   struct timer_wheel timers CACHE_ALIGNED;
+   /*
+    * Queue of the producers waiting for room in the pool. A finished
+    * task's place goes to the longest waiting one.
+    */
+   pthread_mutex_t push_mutex CACHE_ALIGNED;
+   struct push_waiter *push_waiters;
+   struct push_waiter **push_waiters_tail;
+   struct completion_queue completions CACHE_ALIGNED;
+};
+
+/* Worker of the pool the current thread belongs to, NULL for others */
+static __thread struct pool_worker *current_worker;
+/* Task being run by the current thread, the innermost one */
+static __thread struct thread_task *current_task;
+/* Fiber the current thread runs on, NULL on the thread's own stack */
+static __thread struct task_fiber *current_fiber;
+
+static void
+task_ring_create(struct task_ring *ring, size_t min_size)
+{
+   size_t size = 1;
+   while (size < min_size)
+      size <<= 1;
+   ring->cells = calloc(size, sizeof(struct task_ring_cell));
+   ring->mask = size - 1;
+   ring->enqueue_pos = 0;
+   ring->dequeue_pos = 0;
+}
+
+static void
+task_ring_destroy(struct task_ring *ring)
+{
+   free(ring->cells);
+}
+
+/* Returns false if the ring is full */
+static bool
+task_ring_push(struct task_ring *ring, struct thread_task *task)
+{
+   struct task_ring_cell *cell;
+   size_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+   while (true)
+   {
+      cell = &ring->cells[pos & ring->mask];
+      size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) +
+                   (pos & ring->mask);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0)
+      {
+         if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1,
+                                         true, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
+            break;
+      }
+      else if (diff < 0)
+      {
+         return false;
+      }
+      else
+      {
+         pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+      }
+   }
+   __atomic_store_n(&task->ring_cell, cell, __ATOMIC_RELAXED);
+   /* A joiner taking the task back reads the cell, not the sequence */
+   __atomic_store_n(&cell->task, task, __ATOMIC_RELEASE);
+   __atomic_store_n(&cell->sequence, pos + 1 - (pos & ring->mask),
+                    __ATOMIC_RELEASE);
+   return true;
+}
+
+/* Returns NULL if the ring is empty */
+static struct thread_task *
+task_ring_pop(struct task_ring *ring)
+{
+   struct thread_task *task;
+   do
+   {
+      struct task_ring_cell *cell;
+      size_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+      while (true)
+      {
+         cell = &ring->cells[pos & ring->mask];
+         size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) +
+                      (pos & ring->mask);
+         intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+         if (diff == 0)
+         {
+            if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos,
+                                            pos + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+               break;
+         }
+         else if (diff < 0)
+         {
+            return NULL;
+         }
+         else
+         {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+         }
+      }
+      /* Races with a joiner taking the task back, see task_ring_take() */
+      task = __atomic_exchange_n(&cell->task, NULL, __ATOMIC_ACQ_REL);
+      __atomic_store_n(&cell->sequence,
+                       pos + ring->mask + 1 - (pos & ring->mask),
+                       __ATOMIC_RELEASE);
+   } while (task == NULL);
+   __atomic_store_n(&task->ring_cell, NULL, __ATOMIC_RELAXED);
+   return task;
+}
+
+/*
+ * Takes a task back from the ring cell it was pushed to. Returns false
+ * if a consumer got it first.
+ */
+static bool
+task_ring_take(struct task_ring_cell *cell, struct thread_task *task)
+{
+   struct thread_task *expected = task;
+   if (!__atomic_compare_exchange_n(&cell->task, &expected, NULL, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return false;
+   __atomic_store_n(&task->ring_cell, NULL, __ATOMIC_RELAXED);
+   return true;
+}
+
+/* Returns false if @a timeout (relative, NULL for infinity) expired */
+static bool
+futex_wait(uint32_t *addr, uint32_t value, const struct timespec *timeout)
+{
+   return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout,
+                  NULL, 0) == 0 || errno != ETIMEDOUT;
+}
+
+static uint64_t
+clock_monotonic_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Monotonic time @a timeout seconds from now. A timeout of a billion
+ * seconds or more, infinity included, is as good as never.
+ */
+static uint64_t
+deadline_after(double timeout)
+{
+   uint64_t now = clock_monotonic_ns();
+   if (!(timeout > 0))
+      return now;
+   if (timeout >= 1e9)
+      return now + (uint64_t)1e18;
+   return now + (uint64_t)(timeout * 1e9);
+}
+
+static struct timespec
+timespec_from_ns(uint64_t ns)
+{
+   struct timespec ts;
+   ts.tv_sec = ns / 1000000000;
+   ts.tv_nsec = ns % 1000000000;
+   return ts;
+}
+
+static void
+futex_wake(uint32_t *addr, int count)
+{
+   syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void
+trace_ring_create(struct trace_ring *ring, int size)
+{
+   ring->events = size > 0 ? calloc(size, sizeof(struct trace_event)) : NULL;
+   ring->size = size;
+   ring->head = 0;
+}
+
+static void
+trace_ring_write(struct trace_ring *ring, int type,
+                 const struct thread_task *task)
+{
+   uint64_t pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+   struct trace_event *event = &ring->events[pos % ring->size];
+   /*
+    * A seqlock: readers drop the event if seq changes under them. The
+    * acquire of the exchange keeps the data stores after it.
+    */
+   __atomic_exchange_n(&event->seq, 0, __ATOMIC_ACQ_REL);
+   __atomic_store_n(&event->time, clock_monotonic_ns(), __ATOMIC_RELAXED);
+   __atomic_store_n(&event->task, (uintptr_t)task, __ATOMIC_RELAXED);
+   __atomic_store_n(&event->type, type, __ATOMIC_RELAXED);
+   __atomic_store_n(&event->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns false if the event at @a pos is not written or overwritten */
+static bool
+trace_ring_read(const struct trace_ring *ring, uint64_t pos,
+                struct trace_event *out)
+{
+   const struct trace_event *event = &ring->events[pos % ring->size];
+   if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != pos + 1)
+      return false;
+   /* Acquire loads keep the second check of seq after them */
+   out->time = __atomic_load_n(&event->time, __ATOMIC_ACQUIRE);
+   out->task = __atomic_load_n(&event->task, __ATOMIC_ACQUIRE);
+   out->type = __atomic_load_n(&event->type, __ATOMIC_ACQUIRE);
+   return __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == pos + 1;
+}
+
+/* Records an event of the current thread if the pool traces at all */
+static inline void
+thread_pool_trace(struct thread_pool *pool, int type,
+                  const struct thread_task *task)
+{
+   if (__builtin_expect(!pool->is_tracing, 1))
+      return;
+   if (current_worker != NULL && current_worker->pool == pool)
+      trace_ring_write(&current_worker->trace, type, task);
+   else
+      trace_ring_write(&pool->trace, type, task);
+}
+
+static inline uint32_t
+task_state(const struct thread_task *task)
+{
+   return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) & TASK_STATE_MASK;
+}
+
+/* Changes the state keeping the flags, returns the old word */
+static uint32_t
+task_set_state(struct thread_task *task, uint32_t state)
+{
+   uint32_t old = __atomic_load_n(&task->state, __ATOMIC_RELAXED);
+   while (!__atomic_compare_exchange_n(&task->state, &old,
+                                       (old & ~TASK_STATE_MASK) | state, true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+   return old;
+}
+
+/* Drops one dependency of the task, returns true if it was the last one */
+static inline bool
+task_release(struct thread_task *task)
+{
+   return __atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+/*
+ * Allocates memory starting at a cache line. Not aligned_alloc(), so
+ * that allocation checkers see the memory. The pointer malloc() gave is
+ * kept right before the returned one.
+ */
+static void *
+cache_aligned_malloc(size_t size)
+{
+   char *memory = malloc(size + sizeof(void *) + CACHE_LINE_SIZE - 1);
+   char *aligned = (char *)(((uintptr_t)memory + sizeof(void *) +
+                             CACHE_LINE_SIZE - 1) &
+                            ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+   ((void **)aligned)[-1] = memory;
+   return aligned;
+}
+
+static void
+cache_aligned_free(void *ptr)
+{
+   if (ptr != NULL)
+      free(((void **)ptr)[-1]);
+}
+
+static void
+task_slab_create(struct task_slab *slab)
+{
+   pthread_mutex_init(&slab->mutex, NULL);
+   slab->free_list = NULL;
+   slab->chunks = NULL;
+   slab->used_count = 0;
+   slab->in_flight = 0;
+   slab->alloc_count = 0;
+}
+
+static void
+task_slab_destroy(struct task_slab *slab)
+{
+   struct task_slab_chunk *chunk = slab->chunks;
+   while (chunk != NULL)
+   {
+      struct task_slab_chunk *next = chunk->next;
+      cache_aligned_free(chunk);
+      chunk = next;
+   }
+   pthread_mutex_destroy(&slab->mutex);
+}
+
+static struct thread_task *
+task_slab_alloc(struct task_slab *slab)
+{
+   pthread_mutex_lock(&slab->mutex);
+   if (slab->free_list == NULL)
+   {
+      struct task_slab_chunk *chunk = cache_aligned_malloc(sizeof(*chunk));
+      for (int i = 0; i < TASK_SLAB_CHUNK_SIZE; i++)
+      {
+         struct thread_task *task = &chunk->tasks[i];
+         task->slab = slab;
+         task->next = i + 1 < TASK_SLAB_CHUNK_SIZE ? task + 1 : NULL;
+      }
+      chunk->next = slab->chunks;
+      slab->chunks = chunk;
+      slab->free_list = &chunk->tasks[0];
+      slab->alloc_count++;
+   }
+   struct thread_task *task = slab->free_list;
+   slab->free_list = task->next;
+   slab->used_count++;
+   pthread_mutex_unlock(&slab->mutex);
+   return task;
+}
+
+static void
+task_slab_free(struct task_slab *slab, struct thread_task *task)
+{
+   pthread_mutex_lock(&slab->mutex);
+   task->next = slab->free_list;
+   slab->free_list = task;
+   slab->used_count--;
+   pthread_mutex_unlock(&slab->mutex);
+}
+
+/*
+ * Accounts @a count tasks put into (or taken from if negative) the
+ * queues. Only the growth of the total has to be ordered, against the
+ * parking workers and the idle ones, see worker_park(). The level
+ * count is published by it, and the takes only make the hint smaller.
+ */
+static void
+thread_pool_count_queued(struct thread_pool *pool, int priority, int count)
+{
+   __atomic_add_fetch(&pool->queued_counts[priority], count, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&pool->queued_count, count,
+                      count > 0 ? __ATOMIC_SEQ_CST : __ATOMIC_RELAXED);
+}
+
+static void
+task_deque_init(struct task_deque *deque)
+{
+   pthread_mutex_init(&deque->mutex, NULL);
+   deque->first = NULL;
+   deque->last = NULL;
+}
+
+static void
+task_deque_push(struct thread_pool *pool, struct task_deque *deque,
+                struct thread_task *task)
+{
+   pthread_mutex_lock(&deque->mutex);
+   task->next = NULL;
+   task->prev = deque->last;
+   /* Joiners peek at it to find the task */
+   __atomic_store_n(&task->deque, deque, __ATOMIC_RELAXED);
+   /* first and last are peeked at without the lock to skip empty deques */
+   if (deque->last != NULL)
+      deque->last->next = task;
+   else
+      __atomic_store_n(&deque->first, task, __ATOMIC_RELAXED);
+   __atomic_store_n(&deque->last, task, __ATOMIC_RELAXED);
+   thread_pool_count_queued(pool, task->priority, 1);
+   pthread_mutex_unlock(&deque->mutex);
+}
+
+/*
+ * Links a chain of @a count tasks of the same priority, already linked
+ * via their next and prev pointers, to the tail of the deque under one
+ * lock.
+ */
+static void
+task_deque_push_chain(struct thread_pool *pool, struct task_deque *deque,
+                      struct thread_task *first, struct thread_task *last,
+                      int count)
+{
+   pthread_mutex_lock(&deque->mutex);
+   for (struct thread_task *task = first; task != NULL; task = task->next)
+      __atomic_store_n(&task->deque, deque, __ATOMIC_RELAXED);
+   first->prev = deque->last;
+   if (deque->last != NULL)
+      deque->last->next = first;
+   else
+      __atomic_store_n(&deque->first, first, __ATOMIC_RELAXED);
+   __atomic_store_n(&deque->last, last, __ATOMIC_RELAXED);
+   thread_pool_count_queued(pool, first->priority, count);
+   pthread_mutex_unlock(&deque->mutex);
+}
+
+/* Unlinks the task from its deque. The deque mutex must be held */
+static void
+task_deque_unlink(struct thread_pool *pool, struct task_deque *deque,
+                  struct thread_task *task)
+{
+   if (task->prev != NULL)
+      task->prev->next = task->next;
+   else
+      __atomic_store_n(&deque->first, task->next, __ATOMIC_RELAXED);
+   if (task->next != NULL)
+      task->next->prev = task->prev;
+   else
+      __atomic_store_n(&deque->last, task->prev, __ATOMIC_RELAXED);
+   task->next = NULL;
+   task->prev = NULL;
+   __atomic_store_n(&task->deque, NULL, __ATOMIC_RELAXED);
+   thread_pool_count_queued(pool, task->priority, -1);
+}
+
+/* Pops the newest task, used by the deque owner */
+static struct thread_task *
+task_deque_pop(struct thread_pool *pool, struct task_deque *deque)
+{
+   if (__atomic_load_n(&deque->last, __ATOMIC_RELAXED) == NULL)
+      return NULL;
+   pthread_mutex_lock(&deque->mutex);
+   struct thread_task *task = deque->last;
+   if (task != NULL)
+      task_deque_unlink(pool, deque, task);
+   pthread_mutex_unlock(&deque->mutex);
+   return task;
+}
+
+/* Takes the oldest task, used by the workers stealing from the deque */
+static struct thread_task *
+task_deque_steal(struct thread_pool *pool, struct task_deque *deque)
+{
+   if (__atomic_load_n(&deque->first, __ATOMIC_RELAXED) == NULL)
+      return NULL;
+   /* Do not queue up behind the owner, just try another victim */
+   if (pthread_mutex_trylock(&deque->mutex) != 0)
+      return NULL;
+   struct thread_task *task = deque->first;
+   if (task != NULL)
+      task_deque_unlink(pool, deque, task);
+   pthread_mutex_unlock(&deque->mutex);
+   return task;
+}
+
+/* Steals from the workers of the same node or of the other nodes */
+static struct thread_task *
+worker_steal_task(struct pool_worker *worker, int priority, bool is_local)
+{
+   struct thread_pool *pool = worker->pool;
+   /* Empty deques are skipped without locking, so scan all the slots */
+   int count = pool->max_threads_count;
+   unsigned seed = worker->steal_seed;
+   seed ^= seed << 13;
+   seed ^= seed >> 17;
+   seed ^= seed << 5;
+   worker->steal_seed = seed;
+   int start = seed % count;
+   for (int i = 0; i < count; i++)
+   {
+      struct pool_worker *victim = &pool->workers[(start + i) % count];
+      if (victim == worker || (victim->node == worker->node) != is_local)
+         continue;
+      struct thread_task *task = task_deque_steal(pool,
+                                                  &victim->deques[priority]);
+      if (task != NULL)
+      {
+         thread_pool_trace(pool, TRACE_STEAL, task);
+         return task;
+      }
+   }
+   return NULL;
+}
+
+static struct thread_task *
+worker_pop_ring(struct pool_worker *worker, int node, int priority)
+{
+   struct thread_pool *pool = worker->pool;
+   struct thread_task *task = task_ring_pop(&pool->nodes[node].rings[priority]);
+   if (task != NULL)
+      thread_pool_count_queued(pool, priority, -1);
+   return task;
+}
+
+/*
+ * Looks for a task of one priority level: own deque, the node's ring,
+ * the node's other workers. Only then other nodes are looked at.
+ */
+static struct thread_task *
+worker_get_task_at(struct pool_worker *worker, int priority)
+{
+   struct thread_pool *pool = worker->pool;
+   if (__atomic_load_n(&pool->queued_counts[priority], __ATOMIC_RELAXED) <= 0)
+      return NULL;
+   struct thread_task *task = task_deque_pop(pool, &worker->deques[priority]);
+   if (task != NULL)
+      return task;
+   task = worker_pop_ring(worker, worker->node, priority);
+   if (task != NULL)
+      return task;
+   task = worker_steal_task(worker, priority, true);
+   if (task != NULL || pool->node_count == 1)
+      return task;
+   for (int i = 1; i < pool->node_count; i++)
+   {
+      task = worker_pop_ring(worker, (worker->node + i) % pool->node_count,
+                             priority);
+      if (task != NULL)
+         return task;
+   }
+   return worker_steal_task(worker, priority, false);
+}
+
+/*
+ * Drains the higher priority levels first. Once in a while the order is
+ * reversed so the low priority tasks make progress under any load.
+ */
+static struct thread_task *
+worker_get_task(struct pool_worker *worker)
+{
+   bool is_low_first =
+      (worker->pick_count + 1) % WORKER_STARVATION_PERIOD == 0;
+   for (int i = 0; i < TPOOL_PRIORITY_COUNT; i++)
+   {
+      int priority = is_low_first ? TPOOL_PRIORITY_LOW + i :
+                                    TPOOL_PRIORITY_COUNT - 1 - i;
+      struct thread_task *task = worker_get_task_at(worker, priority);
+      if (task != NULL)
+      {
+         worker->pick_count++;
+         /*
+          * The queue only shrinks when a task is taken, so its peak is
+          * always seen by one of the takers.
+          */
+         int depth = __atomic_load_n(&worker->pool->queued_count,
+                                     __ATOMIC_RELAXED) + 1;
+         if (depth > worker->stats.peak_queue_depth)
+            __atomic_store_n(&worker->stats.peak_queue_depth, depth,
+                             __ATOMIC_RELAXED);
+         return task;
+      }
+   }
+   return NULL;
+}
+
+/* Single writer counter increment, readable by the other threads */
+static inline void
+stats_inc(uint64_t *counter)
+{
+   __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1,
+                    __ATOMIC_RELAXED);
+}
+
+/* Histogram bucket i counts durations in [2^i, 2^(i + 1)) nanoseconds */
+static inline int
+stats_bucket(uint64_t ns)
+{
+   if (ns == 0)
+      return 0;
+   int bucket = 63 - __builtin_clzll(ns);
+   return bucket < TPOOL_STATS_BUCKETS ? bucket : TPOOL_STATS_BUCKETS - 1;
+}
+
+static void
+thread_task_destroy(struct thread_task *task)
+{
+   if (task->slab != NULL)
+   {
+      task_slab_free(task->slab, task);
+      return;
+   }
+   cache_aligned_free(task);
+}
+
+static void
+task_release_successors(struct thread_task *task,
+                        struct task_edge *replacement);
+
+static bool
+thread_pool_rearm_task(struct thread_pool *pool, struct thread_task *task);
+
+static void
+thread_pool_unreserve(struct thread_pool *pool, int count);
+
+/* Makes the eventfd readable, which can only fail on counter overflow */
+static void
+completion_queue_signal(struct completion_queue *queue)
+{
+   uint64_t one = 1;
+   ssize_t rc = write(queue->fd, &one, sizeof(one));
+   (void)rc;
+}
+
+/* Hands a finished task over to the pool's completion queue */
+static void
+thread_pool_push_completion(struct thread_pool *pool, struct thread_task *task)
+{
+   struct completion_queue *queue = &pool->completions;
+   struct thread_task *head = __atomic_load_n(&queue->finished,
+                                              __ATOMIC_RELAXED);
+   do
+      task->group_next = head;
+   while (!__atomic_compare_exchange_n(&queue->finished, &head, task, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+   /* The reaper drains the whole stack, so only the first push signals */
+   if (head == NULL)
+      completion_queue_signal(queue);
+   /* The last access to the pool, see thread_pool_delete() */
+   __atomic_sub_fetch(&queue->in_flight, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Accounts a member gone from the group, finished or deleted. The owner
+ * can delete the group right after that, so only the wakeup follows.
+ */
+static void
+task_group_leave(struct thread_task_group *group)
+{
+   uint32_t old = __atomic_fetch_sub(&group->unfinished, 1, __ATOMIC_ACQ_REL);
+   if ((old & GROUP_FLAG_ANY_WAITERS) ||
+       old == (GROUP_FLAG_WAITERS | 1))
+      futex_wake(&group->unfinished, INT_MAX);
+}
+
+/* Hands a finished member over to the group owner */
+static void
+task_group_push_finished(struct thread_task_group *group,
+                         struct thread_task *task)
+{
+   struct thread_task *head = __atomic_load_n(&group->finished,
+                                              __ATOMIC_RELAXED);
+   do
+      task->group_next = head;
+   while (!__atomic_compare_exchange_n(&group->finished, &head, task, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Counts into the worker's stats or, with no worker, the shared ones */
+static inline void
+task_stats_inc(struct pool_worker *worker, uint64_t *counter)
+{
+   if (worker != NULL)
+      stats_inc(counter);
+   else
+      __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void
+thread_pool_finish_task(struct thread_pool *pool, struct pool_worker *worker,
+                        struct thread_task *task, uint64_t started_at,
+                        bool is_cancelled);
+
+/* Runs the task's function on the current stack */
+static void
+task_call(struct thread_task *task)
+{
+   struct thread_task *outer_task = current_task;
+   current_task = task;
+   task->result = task->function(task->arg);
+   current_task = outer_task;
+}
+
+static void
+task_fiber_switch_out(struct task_fiber *fiber)
+{
+#if defined(__SANITIZE_THREAD__)
+   __tsan_switch_to_fiber(fiber->tsan_caller, 0);
+#endif
+   swapcontext(&fiber->context, fiber->caller);
+}
+
+/* Entry of a fiber, it runs one task after another as the worker says */
+static void
+task_fiber_main(void)
+{
+   struct task_fiber *fiber = current_fiber;
+   while (true)
+   {
+      struct thread_task *task = fiber->task;
+      task->result = task->function(task->arg);
+      fiber->is_done = true;
+      task_fiber_switch_out(fiber);
+   }
+}
+
+/* Runs the fiber until it suspends or is done, returns true if done */
+static bool
+task_fiber_switch(struct task_fiber *fiber)
+{
+   ucontext_t caller;
+   struct thread_task *outer_task = current_task;
+   current_task = fiber->task;
+   current_fiber = fiber;
+   fiber->caller = &caller;
+#if defined(__SANITIZE_THREAD__)
+   fiber->tsan_caller = __tsan_get_current_fiber();
+   __tsan_switch_to_fiber(fiber->tsan_fiber, 0);
+#endif
+   swapcontext(&caller, &fiber->context);
+   current_fiber = NULL;
+   current_task = outer_task;
+   return fiber->is_done;
+}
+
+static void
+task_fiber_destroy(struct task_fiber *fiber)
+{
+#if defined(__SANITIZE_THREAD__)
+   __tsan_destroy_fiber(fiber->tsan_fiber);
+#endif
+   munmap(fiber->stack, fiber->stack_size);
+   free(fiber);
+}
+
+/* Aims the context at the fiber's stack above the guard page */
+static void
+task_fiber_create_context(struct task_fiber *fiber, size_t guard_size)
+{
+   getcontext(&fiber->context);
+   fiber->context.uc_stack.ss_sp = fiber->stack + guard_size;
+   fiber->context.uc_stack.ss_size = fiber->stack_size - guard_size;
+   fiber->context.uc_link = NULL;
+   makecontext(&fiber->context, task_fiber_main, 0);
+#if defined(__SANITIZE_THREAD__)
+   fiber->tsan_fiber = __tsan_create_fiber(0);
+#endif
+}
+
+/* Takes a cached fiber or makes a new one, NULL if out of memory */
+static struct task_fiber *
+worker_get_fiber(struct pool_worker *worker)
+{
+   struct task_fiber *fiber = worker->free_fibers;
+   if (fiber != NULL)
+   {
+      worker->free_fibers = fiber->next;
+      worker->free_fiber_count--;
+      return fiber;
+   }
+   size_t page_size = sysconf(_SC_PAGESIZE);
+   size_t stack_size = worker->pool->fiber_stack_size + page_size;
+   /* The pages are committed only when the stack grows into them */
+   char *stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+   if (stack == MAP_FAILED)
+      return NULL;
+   mprotect(stack, page_size, PROT_NONE);
+   fiber = malloc(sizeof(*fiber));
+   fiber->worker = worker;
+   fiber->stack = stack;
+   fiber->stack_size = stack_size;
+   fiber->task = NULL;
+   task_fiber_create_context(fiber, page_size);
+   return fiber;
+}
+
+static void
+worker_put_fiber(struct pool_worker *worker, struct task_fiber *fiber)
+{
+   if (worker->free_fiber_count == FIBER_CACHE_SIZE)
+   {
+      task_fiber_destroy(fiber);
+      return;
+   }
+   fiber->next = worker->free_fibers;
+   worker->free_fibers = fiber;
+   worker->free_fiber_count++;
+}
+
+/*
+ * Switches to the fiber of a task. When the task is done the fiber
+ * goes back to the cache and true is returned.
+ */
+static bool
+task_fiber_run(struct task_fiber *fiber)
+{
+   struct pool_worker *worker = fiber->worker;
+   if (!task_fiber_switch(fiber))
+   {
+      worker->suspended_count++;
+      /* The worker runs others meanwhile, so the trace ends the runs */
+      for (int i = 0; i < fiber->run_depth; i++)
+         thread_pool_trace(worker->pool, TRACE_SUSPEND, fiber->task);
+      return false;
+   }
+   fiber->task->fiber = NULL;
+   fiber->task = NULL;
+   worker_put_fiber(worker, fiber);
+   return true;
+}
+
+/*
+ * Starts the task on a fiber. Returns false if the task suspended in a
+ * join. Without memory for a fiber the task just runs on the worker.
+ */
+static bool
+task_fiber_start(struct pool_worker *worker, struct thread_task *task,
+                 uint64_t started_at)
+{
+   struct task_fiber *fiber = worker_get_fiber(worker);
+   if (fiber == NULL)
+   {
+      task_call(task);
+      return true;
+   }
+   fiber->task = task;
+   fiber->started_at = started_at;
+   fiber->is_done = false;
+   fiber->run_depth = 1;
+   task->fiber = fiber;
+   return task_fiber_run(fiber);
+}
+
+/* Continues a fiber whose awaited task is finished, on its own worker */
+static void
+worker_resume_fiber(struct pool_worker *worker, struct task_fiber *fiber)
+{
+   struct thread_pool *pool = worker->pool;
+   struct thread_task *task = fiber->task;
+   uint64_t started_at = fiber->started_at;
+   worker->suspended_count--;
+   if (worker->run_depth++ == 0)
+      __atomic_sub_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+   for (int i = 0; i < fiber->run_depth; i++)
+      thread_pool_trace(pool, TRACE_RESUME, task);
+   if (!task_fiber_run(fiber))
+   {
+      if (--worker->run_depth == 0)
+         __atomic_add_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+      return;
+   }
+   thread_pool_finish_task(pool, worker, task, started_at, false);
+}
+
+static void
+worker_resume_fibers(struct pool_worker *worker)
+{
+   struct task_fiber *fiber = __atomic_exchange_n(&worker->resumable, NULL,
+                                                  __ATOMIC_ACQUIRE);
+   while (fiber != NULL)
+   {
+      struct task_fiber *next = fiber->next;
+      worker_resume_fiber(worker, fiber);
+      fiber = next;
+   }
+}
+
+static void
+worker_unpark_locked(struct pool_worker *worker);
+
+/* Hands a suspended fiber back to its worker, called by any thread */
+static void
+task_fiber_wake(struct task_fiber *fiber)
+{
+   struct pool_worker *worker = fiber->worker;
+   struct task_fiber *head = __atomic_load_n(&worker->resumable,
+                                             __ATOMIC_RELAXED);
+   do
+      fiber->next = head;
+   while (!__atomic_compare_exchange_n(&worker->resumable, &head, fiber, true,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+   /* The worker looks at its fibers after it is on the parked stack */
+   struct thread_pool *pool = worker->pool;
+   pthread_mutex_lock(&pool->park_mutex);
+   bool is_parked = __atomic_load_n(&worker->park_state, __ATOMIC_RELAXED) ==
+                    WORKER_PARKED;
+   if (is_parked)
+      worker_unpark_locked(worker);
+   pthread_mutex_unlock(&pool->park_mutex);
+   if (is_parked)
+      futex_wake(&worker->park_state, 1);
+}
+
+static bool
+thread_task_claim(struct thread_task *task);
+
+static void
+thread_pool_run_task(struct thread_pool *pool, struct thread_task *task);
+
+/*
+ * Suspends the fiber of the current task until @a awaited is finished,
+ * the worker runs other tasks meanwhile. The awaited task is run right
+ * here if nobody has started it. Returns false if it is finished
+ * already, then there is nothing to suspend for.
+ */
+static bool
+task_fiber_await(struct thread_task *awaited)
+{
+   if (task_state(awaited) == TASK_STATE_QUEUED && thread_task_claim(awaited))
+   {
+      thread_pool_run_task(awaited->pool, awaited);
+      return true;
+   }
+   struct task_fiber *fiber = current_fiber;
+   struct thread_task *task = fiber->task;
+   /* The awaited task releases this one like a successor */
+   struct task_edge *edge = malloc(sizeof(*edge));
+   edge->task = task;
+   __atomic_add_fetch(&task->pending, 1, __ATOMIC_ACQ_REL);
+   struct task_edge *head = __atomic_load_n(&awaited->successors,
+                                            __ATOMIC_ACQUIRE);
+   do
+   {
+      if (head == TASK_EDGES_CLOSED)
+      {
+         task_release(task);
+         free(edge);
+         return false;
+      }
+      edge->next = head;
+   } while (!__atomic_compare_exchange_n(&awaited->successors, &head, edge,
+                                         true, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE));
+   /*
+    * Drop the hold of the running task. If the awaited one has released
+    * it already, there is no wakeup to wait for. Otherwise the wakeup
+    * goes to this worker, which is busy until the fiber is switched out.
+    */
+   if (!task_release(task))
+      task_fiber_switch_out(fiber);
+   __atomic_store_n(&task->pending, 1, __ATOMIC_RELAXED);
+   return true;
+}
+
+/*
+ * Runs a task taken out of the queues. Besides the workers, the threads
+ * joining a task of the pool run its tasks while they wait.
+ */
+static void
+thread_pool_run_task(struct thread_pool *pool, struct thread_task *task)
+{
+   struct pool_worker *worker = current_worker;
+   if (worker != NULL && worker->pool != pool)
+      worker = NULL;
+   struct worker_stats *stats = worker != NULL ? &worker->stats :
+                                                 &pool->helper_stats;
+   /* A worker running a task is busy already when the task joins */
+   if (worker != NULL && worker->run_depth++ == 0)
+      __atomic_sub_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+   /* Restore the hold released by the push for the next one */
+   __atomic_store_n(&task->pending, 1, __ATOMIC_RELAXED);
+   /* A cancel can not be requested anymore without the task seeing it */
+   bool is_cancelled = task_set_state(task, TASK_STATE_RUNNING) &
+                       TASK_FLAG_CANCEL_REQUESTED;
+   thread_pool_trace(pool, TRACE_START, task);
+   uint64_t started_at = clock_monotonic_ns();
+   task_stats_inc(worker, &stats->wait_time_hist[
+      stats_bucket(started_at - task->queued_at)]);
+   if (is_cancelled)
+   {
+      /* A periodic task keeps the result of its last run */
+      if (task->period == 0)
+         task->result = NULL;
+   }
+   else if (worker != NULL && pool->fiber_stack_size != 0 &&
+            current_fiber == NULL)
+   {
+      /* A resume finishes the task if it suspends */
+      if (!task_fiber_start(worker, task, started_at))
+      {
+         if (--worker->run_depth == 0)
+            __atomic_add_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+         return;
+      }
+   }
+   else if (current_fiber != NULL)
+   {
+      /* Run inline, the task is suspended with the fiber it runs on */
+      struct task_fiber *fiber = current_fiber;
+      fiber->run_depth++;
+      task_call(task);
+      fiber->run_depth--;
+   }
+   else
+   {
+      task_call(task);
+   }
+   thread_pool_finish_task(pool, worker, task, started_at, is_cancelled);
+}
+
+/*
+ * Accounts a task as finished and hands it over to whoever waits for
+ * it. The second half of a run, on the worker's stack in case the task
+ * ran on a fiber.
+ */
+static void
+thread_pool_finish_task(struct thread_pool *pool, struct pool_worker *worker,
+                        struct thread_task *task, uint64_t started_at,
+                        bool is_cancelled)
+{
+   struct worker_stats *stats = worker != NULL ? &worker->stats :
+                                                 &pool->helper_stats;
+   task_stats_inc(worker, &stats->run_time_hist[
+      stats_bucket(clock_monotonic_ns() - started_at)]);
+   thread_pool_trace(pool, TRACE_FINISH, task);
+   /* A periodic task stays in the pool until it is cancelled */
+   bool is_rearmed = task->period != 0 && !is_cancelled &&
+                     thread_pool_rearm_task(pool, task);
+   if (!is_rearmed)
+      task_release_successors(task, TASK_EDGES_CLOSED);
+   task_stats_inc(worker, is_cancelled ? &stats->tasks_cancelled :
+                                         &stats->tasks_completed);
+
+   /*
+    * Account the worker as idle and the task as gone before anyone can
+    * see the task finished, so a joiner can re-push it or delete the
+    * pool right away. A task from the pool's slab can be detached and
+    * go back there after that, the deletion waits for it then.
+    */
+   if (worker != NULL && --worker->run_depth == 0)
+      __atomic_add_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+   if (is_rearmed)
+      return;
+   bool is_completion = __atomic_load_n(&task->state, __ATOMIC_RELAXED) &
+                        TASK_FLAG_COMPLETION;
+   if (is_completion)
+      __atomic_add_fetch(&pool->completions.in_flight, 1, __ATOMIC_SEQ_CST);
+   /* Workers count on their own lines, not on a shared hot one */
+   int *slab_in_flight = NULL;
+   if (task->slab != NULL && !is_completion)
+   {
+      slab_in_flight = worker != NULL ? &worker->slab_in_flight :
+                                        &pool->slab.in_flight;
+      __atomic_add_fetch(slab_in_flight, 1, __ATOMIC_SEQ_CST);
+   }
+   thread_pool_unreserve(pool, 1);
+   /* Nobody but the group touches its members, so they stay valid */
+   struct thread_task_group *group = task->group;
+   /* Cancel is the only way to stop a periodic task, so it is no error */
+   bool is_error = is_cancelled && task->period == 0;
+   uint32_t old = task_set_state(task, TASK_STATE_FINISHED |
+                                 (is_error ? TASK_FLAG_CANCELLED : 0));
+   if (is_completion)
+      thread_pool_push_completion(pool, task);
+   else if ((old & TASK_FLAG_DETACHED) ||
+       (group != NULL && group->is_auto_delete))
+      thread_task_destroy(task);
+   else if (group != NULL)
+      task_group_push_finished(group, task);
+   else if (old & TASK_FLAG_WAITERS)
+      futex_wake(&task->state, INT_MAX);
+   /* The last access to the group, its owner can delete it right away */
+   if (group != NULL)
+      task_group_leave(group);
+   if (slab_in_flight != NULL)
+      __atomic_sub_fetch(slab_in_flight, 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#else
+   __asm__ volatile("" ::: "memory");
+#endif
+}
+
+/*
+ * Busy-waits for work a bit before parking, a burst of pushes is then
+ * picked up without a syscall on either side. The spin limit doubles
+ * when spinning pays off and halves when it does not.
+ */
+static struct thread_task *
+worker_spin_for_task(struct pool_worker *worker)
+{
+   struct thread_pool *pool = worker->pool;
+   for (int i = 0; i < worker->spin_limit; i++)
+   {
+      if (__atomic_load_n(&pool->queued_count, __ATOMIC_RELAXED) > 0)
+      {
+         struct thread_task *task = worker_get_task(worker);
+         if (task != NULL)
+         {
+            if (worker->spin_limit < WORKER_SPIN_MAX)
+               worker->spin_limit *= 2;
+            return task;
+         }
+      }
+      if (__atomic_load_n(&pool->is_shutdown, __ATOMIC_RELAXED) ||
+          __atomic_load_n(&worker->resumable, __ATOMIC_RELAXED) != NULL)
+         return NULL;
+      cpu_relax();
+   }
+   if (worker->spin_limit > WORKER_SPIN_MIN)
+      worker->spin_limit /= 2;
+   return NULL;
+}
+
+/* Takes the worker off the parked stack. park_mutex must be held */
+static void
+worker_unpark_locked(struct pool_worker *worker)
+{
+   struct thread_pool *pool = worker->pool;
+   struct pool_worker **pos = &pool->parked;
+   while (*pos != worker)
+      pos = &(*pos)->next_parked;
+   *pos = worker->next_parked;
+   __atomic_sub_fetch(&pool->parked_count, 1, __ATOMIC_SEQ_CST);
+   __atomic_store_n(&worker->park_state, WORKER_AWAKE, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sleeps until a pusher hands the worker a wakeup or the pool dies.
+ * Returns false if nobody needed the worker for the pool's idle timeout.
+ */
+static bool
+worker_park(struct pool_worker *worker)
+{
+   struct thread_pool *pool = worker->pool;
+   pthread_mutex_lock(&pool->park_mutex);
+   __atomic_store_n(&worker->park_state, WORKER_PARKED, __ATOMIC_RELAXED);
+   worker->next_parked = pool->parked;
+   pool->parked = worker;
+   __atomic_add_fetch(&pool->parked_count, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock(&pool->park_mutex);
+   /*
+    * Pushers bump queued_count before they look at parked_count, and
+    * here it is vice versa, so a wakeup can not be lost.
+    */
+   if (__atomic_load_n(&pool->queued_count, __ATOMIC_SEQ_CST) > 0 ||
+       __atomic_load_n(&worker->resumable, __ATOMIC_SEQ_CST) != NULL ||
+       __atomic_load_n(&pool->is_shutdown, __ATOMIC_SEQ_CST))
+   {
+      pthread_mutex_lock(&pool->park_mutex);
+      if (__atomic_load_n(&worker->park_state, __ATOMIC_RELAXED) ==
+          WORKER_PARKED)
+         worker_unpark_locked(worker);
+      pthread_mutex_unlock(&pool->park_mutex);
+      return true;
+   }
+   uint64_t deadline = 0;
+   if (pool->idle_timeout > 0)
+      deadline = deadline_after(pool->idle_timeout);
+   while (__atomic_load_n(&worker->park_state, __ATOMIC_ACQUIRE) ==
+          WORKER_PARKED)
+   {
+      if (deadline == 0)
+      {
+         futex_wait(&worker->park_state, WORKER_PARKED, NULL);
+         continue;
+      }
+      uint64_t now = clock_monotonic_ns();
+      struct timespec timeout = timespec_from_ns(now < deadline ?
+                                                 deadline - now : 0);
+      if (now < deadline &&
+          futex_wait(&worker->park_state, WORKER_PARKED, &timeout))
+         continue;
+      /* A wakeup might be racing with the timeout, let it win */
+      bool is_timed_out = false;
+      pthread_mutex_lock(&pool->park_mutex);
+      if (__atomic_load_n(&worker->park_state, __ATOMIC_RELAXED) ==
+          WORKER_PARKED)
+      {
+         worker_unpark_locked(worker);
+         is_timed_out = true;
+      }
+      pthread_mutex_unlock(&pool->park_mutex);
+      return !is_timed_out;
+   }
+   return true;
+}
+
+/*
+ * Gives up the worker's slot after an idle timeout. Returns false if
+ * work showed up meanwhile and the worker took its slot back.
+ */
+static bool
+worker_retire(struct pool_worker *worker)
+{
+   struct thread_pool *pool = worker->pool;
+   __atomic_store_n(&worker->slot_state, SLOT_EXITING, __ATOMIC_SEQ_CST);
+   __atomic_sub_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+   __atomic_sub_fetch(&pool->active_threads, 1, __ATOMIC_SEQ_CST);
+   __atomic_add_fetch(&pool->workers_retired, 1, __ATOMIC_RELAXED);
+   /*
+    * A pusher which saw this worker as idle might have decided not to
+    * start a new thread. Pushers bump queued_count before looking at
+    * idle_threads, so at least one side notices the other. The slot can
+    * be taken back only until a spawner claims it for a new thread.
+    */
+   int state = SLOT_EXITING;
+   if (__atomic_load_n(&pool->queued_count, __ATOMIC_SEQ_CST) > 0 &&
+       !__atomic_load_n(&pool->is_shutdown, __ATOMIC_SEQ_CST) &&
+       __atomic_compare_exchange_n(&worker->slot_state, &state, SLOT_ALIVE,
+                                   false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+   {
+      __atomic_add_fetch(&pool->active_threads, 1, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+      __atomic_sub_fetch(&pool->workers_retired, 1, __ATOMIC_RELAXED);
+      return false;
+   }
+   return true;
+}
+
+/* Attributes of a new thread of the pool, to be destroyed by the caller */
+static void
+thread_pool_thread_attr(const struct thread_pool *pool, pthread_attr_t *attr)
+{
+   pthread_attr_init(attr);
+   /* The stack pages are committed only when the thread touches them */
+   if (pool->stack_size != 0)
+      pthread_attr_setstacksize(attr, pool->stack_size);
+   if (pool->guard_size != 0)
+      pthread_attr_setguardsize(attr, pool->guard_size);
+}
+
+/* Names the calling thread of the pool "<prefix>-<suffix>" */
+static void
+thread_pool_name_thread(const struct thread_pool *pool, const char *suffix)
+{
+   if (pool->thread_name[0] == 0)
+      return;
+   char name[THREAD_NAME_PREFIX_MAX + 16];
+   snprintf(name, sizeof(name), "%s-%s", pool->thread_name, suffix);
+   /* The kernel keeps 15 chars, a long prefix can cut the suffix */
+   name[15] = 0;
+   pthread_setname_np(pthread_self(), name);
+}
+
+/* Main loop of a worker thread: runs own tasks, steals or sleeps */
+static void *
+worker_f(void *arg)
+{
+   struct pool_worker *worker = arg;
+   struct thread_pool *pool = worker->pool;
+   current_worker = worker;
+   char number[8];
+   snprintf(number, sizeof(number), "%d", (int)(worker - pool->workers));
+   thread_pool_name_thread(pool, number);
+   while (true)
+   {
+      if (__atomic_load_n(&worker->resumable, __ATOMIC_RELAXED) != NULL)
+         worker_resume_fibers(worker);
+      struct thread_task *task = worker_get_task(worker);
+      if (task == NULL)
+         task = worker_spin_for_task(worker);
+      if (task != NULL)
+      {
+         thread_pool_run_task(pool, task);
+         continue;
+      }
+      if (__atomic_load_n(&worker->resumable, __ATOMIC_RELAXED) != NULL)
+         continue;
+      if (__atomic_load_n(&pool->is_shutdown, __ATOMIC_SEQ_CST))
+         break;
+      thread_pool_trace(pool, TRACE_PARK, NULL);
+      bool is_woken = worker_park(worker);
+      thread_pool_trace(pool, TRACE_WAKE, NULL);
+      /* The suspended fibers keep the worker alive */
+      if (!is_woken && worker->suspended_count == 0 &&
+          worker_retire(worker))
+         break;
+   }
+   while (worker->free_fibers != NULL)
+   {
+      struct task_fiber *fiber = worker->free_fibers;
+      worker->free_fibers = fiber->next;
+      task_fiber_destroy(fiber);
+   }
+   worker->free_fiber_count = 0;
+   current_worker = NULL;
+   return NULL;
+}
+
+static bool
+thread_pool_need_thread(struct thread_pool *pool)
+{
+   return __atomic_load_n(&pool->active_threads, __ATOMIC_RELAXED) <
+          pool->max_threads_count &&
+          __atomic_load_n(&pool->queued_count, __ATOMIC_SEQ_CST) >
+          __atomic_load_n(&pool->idle_threads, __ATOMIC_SEQ_CST);
+}
+
+/* Finds a slot for a new worker. spawn_mutex must be held */
+static struct pool_worker *
+thread_pool_take_slot(struct thread_pool *pool)
+{
+   for (int i = 0; i < pool->max_threads_count; i++)
+   {
+      struct pool_worker *worker = &pool->workers[i];
+      if (__atomic_load_n(&worker->slot_state, __ATOMIC_SEQ_CST) == SLOT_FREE)
+         return worker;
+   }
+   for (int i = 0; i < pool->max_threads_count; i++)
+   {
+      struct pool_worker *worker = &pool->workers[i];
+      int state = SLOT_EXITING;
+      /* Once claimed, the retired thread can not take the slot back */
+      if (__atomic_compare_exchange_n(&worker->slot_state, &state, SLOT_FREE,
+                                      false, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_SEQ_CST))
+      {
+         pthread_join(worker->thread, NULL);
+         return worker;
+      }
+   }
+   return NULL;
+}
+
+/* Starts workers while there are more queued tasks than idle ones */
+static void
+thread_pool_grow(struct thread_pool *pool)
+{
+   if (!thread_pool_need_thread(pool))
+      return;
+   pthread_mutex_lock(&pool->spawn_mutex);
+   while (thread_pool_need_thread(pool))
+   {
+      struct pool_worker *worker = thread_pool_take_slot(pool);
+      if (worker == NULL)
+         break;
+      __atomic_add_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch(&pool->active_threads, 1, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&worker->slot_state, SLOT_ALIVE, __ATOMIC_SEQ_CST);
+      pthread_attr_t attr;
+      thread_pool_thread_attr(pool, &attr);
+      if (worker->cpu >= 0)
+      {
+         cpu_set_t cpu_set;
+         CPU_ZERO(&cpu_set);
+         CPU_SET(worker->cpu, &cpu_set);
+         pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+      }
+      int rc = pthread_create(&worker->thread, &attr, worker_f, worker);
+      pthread_attr_destroy(&attr);
+      if (rc != 0)
+      {
+         __atomic_store_n(&worker->slot_state, SLOT_FREE, __ATOMIC_SEQ_CST);
+         __atomic_sub_fetch(&pool->active_threads, 1, __ATOMIC_SEQ_CST);
+         __atomic_sub_fetch(&pool->idle_threads, 1, __ATOMIC_SEQ_CST);
+         break;
+      }
+      __atomic_add_fetch(&pool->workers_created, 1, __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&pool->spawn_mutex);
+}
+
+/* Wakes up to @a count parked workers, one per call of futex_wake */
+static void
+thread_pool_wakeup(struct thread_pool *pool, int count)
+{
+   if (__atomic_load_n(&pool->parked_count, __ATOMIC_SEQ_CST) == 0)
+      return;
+   pthread_mutex_lock(&pool->park_mutex);
+   struct pool_worker *woken = NULL;
+   while (count-- > 0 && pool->parked != NULL)
+   {
+      struct pool_worker *worker = pool->parked;
+      pool->parked = worker->next_parked;
+      worker->next_parked = woken;
+      woken = worker;
+      __atomic_sub_fetch(&pool->parked_count, 1, __ATOMIC_SEQ_CST);
+   }
+   pthread_mutex_unlock(&pool->park_mutex);
+   /* Worker objects live as long as the pool, so wake them unlocked */
+   while (woken != NULL)
+   {
+      struct pool_worker *next = woken->next_parked;
+      __atomic_store_n(&woken->park_state, WORKER_AWAKE, __ATOMIC_RELEASE);
+      futex_wake(&woken->park_state, 1);
+      woken = next;
+   }
+}
+
+/* Accounts @a count more tasks in the pool unless it exceeds the limit */
+static bool
+thread_pool_reserve(struct thread_pool *pool, int count)
+{
+   int tasks_count = __atomic_load_n(&pool->tasks_count, __ATOMIC_RELAXED);
+   do
+   {
+      if (tasks_count > TPOOL_MAX_TASKS - count)
+         return false;
+   } while (!__atomic_compare_exchange_n(&pool->tasks_count, &tasks_count,
+                                         tasks_count + count, true,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+   return true;
+}
+
+/* Reserves room for the blocked producers in their order */
+static void
+thread_pool_grant_waiters(struct thread_pool *pool)
+{
+   pthread_mutex_lock(&pool->push_mutex);
+   while (pool->push_waiters != NULL && thread_pool_reserve(pool, 1))
+   {
+      struct push_waiter *waiter = pool->push_waiters;
+      pool->push_waiters = waiter->next;
+      if (pool->push_waiters == NULL)
+         pool->push_waiters_tail = &pool->push_waiters;
+      __atomic_sub_fetch(&pool->push_waiter_count, 1, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&waiter->is_granted, 1, __ATOMIC_RELEASE);
+      futex_wake(&waiter->is_granted, 1);
+   }
+   pthread_mutex_unlock(&pool->push_mutex);
+}
+
+/*
+ * Takes tasks out of the pool's count. Producers add themselves to the
+ * waiters before retrying a reserve, and here it is vice versa, so a
+ * freed place can not be missed by both.
+ */
+static void
+thread_pool_unreserve(struct thread_pool *pool, int count)
+{
+   /*
+    * With the count at 0 the owner can delete the pool right away. It
+    * joins the workers, and waits out the other threads still here.
+    */
+   bool is_foreign = current_worker == NULL || current_worker->pool != pool;
+   if (is_foreign)
+      __atomic_add_fetch(&pool->unreserving_count, 1, __ATOMIC_SEQ_CST);
+   int left = __atomic_sub_fetch(&pool->tasks_count, count, __ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&pool->push_waiter_count, __ATOMIC_SEQ_CST) > 0)
+      thread_pool_grant_waiters(pool);
+   /* The same order with the idle waiters, only the last task wakes them */
+   if (left == 0 &&
+       __atomic_load_n(&pool->idle_waiter_count, __ATOMIC_SEQ_CST) > 0)
+      futex_wake((uint32_t *)&pool->tasks_count, INT_MAX);
+   if (is_foreign)
+      __atomic_sub_fetch(&pool->unreserving_count, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Waits in the queue of the producers until a task is reserved for the
+ * caller. Returns false on timeout.
+ */
+static bool
+thread_pool_wait_reserve(struct thread_pool *pool, double timeout)
+{
+   struct push_waiter waiter = { .next = NULL, .is_granted = 0 };
+   pthread_mutex_lock(&pool->push_mutex);
+   *pool->push_waiters_tail = &waiter;
+   pool->push_waiters_tail = &waiter.next;
+   __atomic_add_fetch(&pool->push_waiter_count, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock(&pool->push_mutex);
+   /* The room might have been freed before the waiter was seen */
+   thread_pool_grant_waiters(pool);
+
+   uint64_t deadline = deadline_after(timeout);
+   while (!__atomic_load_n(&waiter.is_granted, __ATOMIC_ACQUIRE))
+   {
+      uint64_t now = clock_monotonic_ns();
+      if (now >= deadline)
+         break;
+      struct timespec ts = timespec_from_ns(deadline - now);
+      futex_wait(&waiter.is_granted, 0, &ts);
+   }
+   if (__atomic_load_n(&waiter.is_granted, __ATOMIC_ACQUIRE))
+      return true;
+   /* Granting happens under the mutex, so it is either done or never */
+   pthread_mutex_lock(&pool->push_mutex);
+   bool is_granted = __atomic_load_n(&waiter.is_granted, __ATOMIC_ACQUIRE);
+   if (!is_granted)
+   {
+      struct push_waiter **pos = &pool->push_waiters;
+      while (*pos != &waiter)
+         pos = &(*pos)->next;
+      *pos = waiter.next;
+      if (pool->push_waiters_tail == &waiter.next)
+         pool->push_waiters_tail = pos;
+      __atomic_sub_fetch(&pool->push_waiter_count, 1, __ATOMIC_SEQ_CST);
+   }
+   pthread_mutex_unlock(&pool->push_mutex);
+   return is_granted;
+}
+
+static void
+thread_task_prepare_push(struct thread_pool *pool, struct thread_task *task)
+{
+   task->pool = pool;
+   task->period = 0;
+   /* The ring of a previous push can be gone with its pool by now */
+   __atomic_store_n(&task->ring_cell, NULL, __ATOMIC_RELAXED);
+   /*
+    * Group members are reported by their group instead, and the pieces of
+    * a parallel loop are joined by the loop itself.
+    */
+   uint32_t flags = pool->completions.fd >= 0 && task->group == NULL &&
+                    !task->is_internal ? TASK_FLAG_COMPLETION : 0;
+   __atomic_store_n(&task->state, TASK_STATE_QUEUED | flags,
+                    __ATOMIC_RELEASE);
+}
+
+/*
+ * Puts a pushed task into a queue. Workers keep what they spawn in their
+ * own deque, everything else goes through the lock-free injection ring.
+ * Returns false if the ring is full.
+ */
+static bool
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task *task)
+{
+   task->queued_at = clock_monotonic_ns();
+   thread_pool_trace(pool, TRACE_PUSH, task);
+   if (current_worker != NULL && current_worker->pool == pool)
+   {
+      task_deque_push(pool, &current_worker->deques[task->priority], task);
+      return true;
+   }
+   int node = 0;
+   if (pool->node_count > 1)
+   {
+      /* Keep the task on the node of the pushing thread */
+      int cpu = sched_getcpu();
+      if (cpu >= 0 && cpu < CPU_SETSIZE)
+         node = pool->cpu_nodes[cpu];
+   }
+   if (!task_ring_push(&pool->nodes[node].rings[task->priority], task))
+      return false;
+   thread_pool_count_queued(pool, task->priority, 1);
+   return true;
+}
+
+/* Queues a pushed task whose last predecessor has just gone */
+static void
+thread_pool_push_released(struct thread_task *task)
+{
+   struct thread_pool *pool = task->pool;
+   /*
+    * The task can finish right after it is queued. Until the workers are
+    * woken up, keep the pool from being deleted by its owner, unless
+    * this is one of the pool's own workers, which the deletion joins.
+    */
+   bool is_foreign = current_worker == NULL || current_worker->pool != pool;
+   if (is_foreign)
+      __atomic_add_fetch(&pool->tasks_count, 1, __ATOMIC_SEQ_CST);
+   if (task->fiber != NULL)
+   {
+      /* A task suspended in a join, only its worker can continue it */
+      task_fiber_wake(task->fiber);
+   }
+   else
+   {
+      /* The ring is big enough for the pool's tasks, a slow reader aside */
+      while (!thread_pool_enqueue(pool, task))
+         sched_yield();
+      thread_pool_grow(pool);
+      thread_pool_wakeup(pool, 1);
+   }
+   if (is_foreign)
+      thread_pool_unreserve(pool, 1);
+}
+
+/*
+ * Detaches the successors list replacing it with @a replacement and
+ * drops one dependency of each successor, queuing those which are ready.
+ */
+static void
+task_release_successors(struct thread_task *task,
+                        struct task_edge *replacement)
+{
+   struct task_edge *edge = __atomic_exchange_n(&task->successors,
+                                                replacement, __ATOMIC_ACQ_REL);
+   while (edge != NULL && edge != TASK_EDGES_CLOSED)
+   {
+      struct task_edge *next = edge->next;
+      if (task_release(edge->task))
+         thread_pool_push_released(edge->task);
+      free(edge);
+      edge = next;
+   }
+}
+
+/* Tick of the wheel a due time falls into, rounded up to never be early */
+static uint64_t
+timer_wheel_tick(const struct timer_wheel *wheel, uint64_t time)
+{
+   if (time <= wheel->start)
+      return 0;
+   return (time - wheel->start + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+}
+
+/*
+ * Puts a task into the slot of the lowest level covering its due tick.
+ * wheel->mutex must be held.
+ */
+static void
+timer_wheel_link(struct timer_wheel *wheel, struct thread_task *task)
+{
+   uint64_t tick = timer_wheel_tick(wheel, task->due_at);
+   if (tick < wheel->current_tick)
+      tick = wheel->current_tick;
+   /* Too far for the top level, it is put back there once it comes up */
+   uint64_t max_delta = (1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+   if (tick - wheel->current_tick > max_delta)
+      tick = wheel->current_tick + max_delta;
+   uint64_t delta = tick - wheel->current_tick;
+   int level = 0;
+   while (level < TIMER_LEVELS - 1 &&
+          delta >= 1ull << (TIMER_SLOT_BITS * (level + 1)))
+      level++;
+   int slot = (tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+   struct thread_task **head = &wheel->slots[level][slot];
+   task->prev = NULL;
+   task->next = *head;
+   if (*head != NULL)
+      (*head)->prev = task;
+   *head = task;
+   task->timer_slot = head;
+   wheel->count++;
+}
+
+/* wheel->mutex must be held */
+static void
+timer_wheel_unlink(struct timer_wheel *wheel, struct thread_task *task)
+{
+   if (task->prev != NULL)
+      task->prev->next = task->next;
+   else
+      *task->timer_slot = task->next;
+   if (task->next != NULL)
+      task->next->prev = task->prev;
+   task->next = NULL;
+   task->prev = NULL;
+   task->timer_slot = NULL;
+   wheel->count--;
+}
+
+/* Relinks the tasks of a higher level slot closer to the bottom */
+static void
+timer_wheel_cascade(struct timer_wheel *wheel, int level, int slot)
+{
+   struct thread_task *task = wheel->slots[level][slot];
+   wheel->slots[level][slot] = NULL;
+   while (task != NULL)
+   {
+      struct thread_task *next = task->next;
+      wheel->count--;
+      timer_wheel_link(wheel, task);
+      task = next;
+   }
+}
+
+/*
+ * Moves the wheel up to @a now_tick inclusive, collecting the due tasks
+ * into a list linked via next. wheel->mutex must be held.
+ */
+static struct thread_task *
+timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_tick)
+{
+   struct thread_task *due = NULL;
+   while (wheel->current_tick <= now_tick)
+   {
+      if (wheel->count == 0)
+      {
+         wheel->current_tick = now_tick + 1;
+         break;
+      }
+      uint64_t tick = wheel->current_tick;
+      /* On a boundary of a higher level, its slot spreads down first */
+      int top = 0;
+      while (top < TIMER_LEVELS - 1 &&
+             (tick & ((1ull << (TIMER_SLOT_BITS * (top + 1))) - 1)) == 0)
+         top++;
+      for (int level = top; level > 0; level--)
+         timer_wheel_cascade(wheel, level,
+                             (tick >> (TIMER_SLOT_BITS * level)) &
+                             (TIMER_SLOTS - 1));
+      struct thread_task **head = &wheel->slots[0][tick & (TIMER_SLOTS - 1)];
+      while (*head != NULL)
+      {
+         struct thread_task *task = *head;
+         timer_wheel_unlink(wheel, task);
+         task->next = due;
+         due = task;
+      }
+      wheel->current_tick++;
+   }
+   return due;
+}
+
+/*
+ * The nearest tick the timer thread has to wake up at: a due task at
+ * the bottom level or the next cascade. UINT64_MAX if there are no
+ * tasks. wheel->mutex must be held.
+ */
+static uint64_t
+timer_wheel_next_tick(const struct timer_wheel *wheel)
+{
+   if (wheel->count == 0)
+      return UINT64_MAX;
+   uint64_t tick = wheel->current_tick;
+   do
+   {
+      if (wheel->slots[0][tick & (TIMER_SLOTS - 1)] != NULL)
+         break;
+      tick++;
+   } while ((tick & (TIMER_SLOTS - 1)) != 0);
+   return tick;
+}
+
+/* Sleeps until the nearest due tick, queues the due tasks */
+static void *
+timer_f(void *arg)
+{
+   struct thread_pool *pool = arg;
+   struct timer_wheel *wheel = &pool->timers;
+   thread_pool_name_thread(pool, "timer");
+   pthread_mutex_lock(&wheel->mutex);
+   while (!wheel->is_stopped)
+   {
+      uint64_t now = clock_monotonic_ns();
+      struct thread_task *due =
+         timer_wheel_advance(wheel, (now - wheel->start) / TIMER_TICK_NS);
+      if (due != NULL)
+      {
+         pthread_mutex_unlock(&wheel->mutex);
+         while (due != NULL)
+         {
+            struct thread_task *next = due->next;
+            due->next = NULL;
+            /* It might still wait for its predecessors */
+            if (task_release(due))
+               thread_pool_push_released(due);
+            due = next;
+         }
+         pthread_mutex_lock(&wheel->mutex);
+         continue;
+      }
+      wheel->wakeup_tick = timer_wheel_next_tick(wheel);
+      if (wheel->wakeup_tick == UINT64_MAX)
+      {
+         pthread_cond_wait(&wheel->cond, &wheel->mutex);
+      }
+      else
+      {
+         struct timespec deadline = timespec_from_ns(
+            wheel->start + wheel->wakeup_tick * TIMER_TICK_NS);
+         pthread_cond_timedwait(&wheel->cond, &wheel->mutex, &deadline);
+      }
+   }
+   pthread_mutex_unlock(&wheel->mutex);
+   return NULL;
+}
+
+static void
+timer_wheel_create(struct timer_wheel *wheel)
+{
+   pthread_mutex_init(&wheel->mutex, NULL);
+   pthread_condattr_t attr;
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&wheel->cond, &attr);
+   pthread_condattr_destroy(&attr);
+   wheel->is_started = false;
+   wheel->is_stopped = false;
+   wheel->start = clock_monotonic_ns();
+   wheel->current_tick = 0;
+   wheel->wakeup_tick = UINT64_MAX;
+   wheel->count = 0;
+   memset(wheel->slots, 0, sizeof(wheel->slots));
+}
+
+static void
+timer_wheel_destroy(struct timer_wheel *wheel)
+{
+   pthread_mutex_lock(&wheel->mutex);
+   wheel->is_stopped = true;
+   pthread_cond_signal(&wheel->cond);
+   pthread_mutex_unlock(&wheel->mutex);
+   if (wheel->is_started)
+      pthread_join(wheel->thread, NULL);
+   pthread_cond_destroy(&wheel->cond);
+   pthread_mutex_destroy(&wheel->mutex);
+}
+
+/*
+ * Hands a pushed task to the timer thread, starting it on first use.
+ * Returns false if the thread can not be started.
+ */
+static bool
+thread_pool_add_timer(struct thread_pool *pool, struct thread_task *task)
+{
+   struct timer_wheel *wheel = &pool->timers;
+   pthread_mutex_lock(&wheel->mutex);
+   if (!wheel->is_started)
+   {
+      pthread_attr_t attr;
+      thread_pool_thread_attr(pool, &attr);
+      int rc = pthread_create(&wheel->thread, &attr, timer_f, pool);
+      pthread_attr_destroy(&attr);
+      if (rc != 0)
+      {
+         pthread_mutex_unlock(&wheel->mutex);
+         return false;
+      }
+      wheel->is_started = true;
+   }
+   timer_wheel_link(wheel, task);
+   /* Wake the thread up if it sleeps past the new task */
+   if (timer_wheel_tick(wheel, task->due_at) < wheel->wakeup_tick)
+   {
+      wheel->wakeup_tick = 0;
+      pthread_cond_signal(&wheel->cond);
+   }
+   pthread_mutex_unlock(&wheel->mutex);
+   return true;
+}
+
+/* Takes a task waiting for its time off the wheel */
+static bool
+thread_pool_remove_timer(struct thread_pool *pool, struct thread_task *task)
+{
+   struct timer_wheel *wheel = &pool->timers;
+   pthread_mutex_lock(&wheel->mutex);
+   bool is_removed = task->timer_slot != NULL;
+   if (is_removed)
+      timer_wheel_unlink(wheel, task);
+   pthread_mutex_unlock(&wheel->mutex);
+   return is_removed;
+}
+
+/*
+ * Puts a periodic task back on the wheel after a run. Returns false if
+ * it is cancelled and has to finish instead.
+ */
+static bool
+thread_pool_rearm_task(struct thread_pool *pool, struct thread_task *task)
+{
+   uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+   do
+   {
+      if (state & TASK_FLAG_CANCEL_REQUESTED)
+         return false;
+   } while (!__atomic_compare_exchange_n(&task->state, &state,
+                                         (state & ~TASK_STATE_MASK) |
+                                         TASK_STATE_QUEUED, true,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+   /* Keep the rate, but do not try to catch up with the missed runs */
+   uint64_t now = clock_monotonic_ns();
+   task->due_at += task->period;
+   if (task->due_at < now)
+      task->due_at = now;
+   /* The timer thread is running already, so this can not fail */
+   thread_pool_add_timer(pool, task);
+   return true;
+}
+
+void
+thread_pool_options_init(struct thread_pool_options *options)
+{
+   options->max_thread_count = TPOOL_MAX_THREADS;
+   options->idle_timeout = 0;
+   options->affinity = TPOOL_AFFINITY_NONE;
+   options->cpus = NULL;
+   options->cpu_count = 0;
+   options->trace_size = 0;
+   options->completion_queue = false;
+   options->fiber_stack_size = 0;
+   options->stack_size = 0;
+   options->guard_size = 0;
+   options->thread_name = "tpool";
+}
+
+/*
+ * Reads the NUMA node of each of CPU_SETSIZE CPUs from sysfs. Without
+ * the NUMA info all the CPUs are on node 0.
+ */
+static void
+numa_read_cpu_nodes(int *cpu_nodes)
+{
+   for (int i = 0; i < CPU_SETSIZE; i++)
+      cpu_nodes[i] = 0;
+   DIR *dir = opendir("/sys/devices/system/node");
+   if (dir == NULL)
+      return;
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL)
+   {
+      int node;
+      if (sscanf(entry->d_name, "node%d", &node) != 1 || node < 0 ||
+          node >= CPU_SETSIZE)
+         continue;
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+               entry->d_name);
+      FILE *file = fopen(path, "r");
+      if (file == NULL)
+         continue;
+      /* The list looks like 0-3,8,10-11 */
+      int first;
+      while (fscanf(file, "%d", &first) == 1)
+      {
+         int last = first;
+         int c = fgetc(file);
+         if (c == '-')
+         {
+            if (fscanf(file, "%d", &last) != 1)
+               break;
+            c = fgetc(file);
+         }
+         for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+         {
+            if (cpu >= 0)
+               cpu_nodes[cpu] = node;
+         }
+         if (c != ',')
+            break;
+      }
+      fclose(file);
+   }
+   closedir(dir);
+}
+
+/*
+ * Assigns CPUs and NUMA nodes to the worker slots as the options say.
+ * Returns false if the options name a CPU the process can not run on.
+ */
+static bool
+thread_pool_place_workers(struct thread_pool *pool,
+                          const struct thread_pool_options *options)
+{
+   pool->node_count = 1;
+   pool->cpu_nodes = NULL;
+   for (int i = 0; i < pool->max_threads_count; i++)
+   {
+      pool->workers[i].cpu = -1;
+      pool->workers[i].node = 0;
+   }
+   if (options->affinity == TPOOL_AFFINITY_NONE)
+      return true;
+
+   cpu_set_t allowed;
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+      return false;
+   int cpus[CPU_SETSIZE];
+   int cpu_count = 0;
+   if (options->cpus != NULL)
+   {
+      cpu_set_t seen;
+      CPU_ZERO(&seen);
+      for (int i = 0; i < options->cpu_count; i++)
+      {
+         int cpu = options->cpus[i];
+         if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed) ||
+             CPU_ISSET(cpu, &seen))
+            return false;
+         CPU_SET(cpu, &seen);
+         cpus[cpu_count++] = cpu;
+      }
+   }
+   else
+   {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      {
+         if (CPU_ISSET(cpu, &allowed))
+            cpus[cpu_count++] = cpu;
+      }
+   }
+   if (cpu_count == 0)
+      return false;
+
+   int *os_nodes = malloc(sizeof(int) * CPU_SETSIZE);
+   numa_read_cpu_nodes(os_nodes);
+   /* Group the CPUs by node keeping their order within a node */
+   for (int i = 1; i < cpu_count; i++)
+   {
+      int cpu = cpus[i];
+      int j = i;
+      for (; j > 0 && os_nodes[cpus[j - 1]] > os_nodes[cpu]; j--)
+         cpus[j] = cpus[j - 1];
+      cpus[j] = cpu;
+   }
+   /* Pool node index of each CPU's node, -1 for the nodes not used */
+   int *node_index = malloc(sizeof(int) * CPU_SETSIZE);
+   int node_start[CPU_SETSIZE + 1];
+   for (int i = 0; i < CPU_SETSIZE; i++)
+      node_index[i] = -1;
+   int node_count = 0;
+   for (int i = 0; i < cpu_count; i++)
+   {
+      int os_node = os_nodes[cpus[i]];
+      if (node_index[os_node] < 0)
+      {
+         node_index[os_node] = node_count;
+         node_start[node_count++] = i;
+      }
+   }
+   node_start[node_count] = cpu_count;
+
+   for (int i = 0; i < pool->max_threads_count; i++)
+   {
+      struct pool_worker *worker = &pool->workers[i];
+      if (options->affinity == TPOOL_AFFINITY_COMPACT)
+      {
+         worker->cpu = cpus[i % cpu_count];
+      }
+      else
+      {
+         int node = i % node_count;
+         int node_size = node_start[node + 1] - node_start[node];
+         worker->cpu = cpus[node_start[node] + (i / node_count) % node_size];
+      }
+      worker->node = node_index[os_nodes[worker->cpu]];
+   }
+   pool->node_count = node_count;
+   if (node_count > 1)
+   {
+      /* Threads on the CPUs of other nodes push to the nodes in turn */
+      pool->cpu_nodes = malloc(sizeof(int) * CPU_SETSIZE);
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      {
+         int node = node_index[os_nodes[cpu]];
+         pool->cpu_nodes[cpu] = node >= 0 ? node : cpu % node_count;
+      }
+   }
+   free(node_index);
+   free(os_nodes);
+   return true;
+}
+
+int
+thread_pool_new(int max_thread_count, struct thread_pool **pool)
+{
+   struct thread_pool_options options;
+   thread_pool_options_init(&options);
+   options.max_thread_count = max_thread_count;
+   return thread_pool_new_ex(&options, pool);
+}
+
+int
+thread_pool_new_ex(const struct thread_pool_options *options,
+                   struct thread_pool **pool)
+{
+   int max_thread_count = options->max_thread_count;
+	if (max_thread_count > TPOOL_MAX_THREADS || max_thread_count <= 0)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (!(options->idle_timeout >= 0))
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (options->affinity < TPOOL_AFFINITY_NONE ||
+       options->affinity > TPOOL_AFFINITY_ROUND_ROBIN)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (options->cpus != NULL &&
+       (options->cpu_count <= 0 || options->cpu_count > CPU_SETSIZE))
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (options->trace_size < 0)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (options->fiber_stack_size != 0 &&
+       options->fiber_stack_size < FIBER_STACK_MIN)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (options->stack_size != 0 &&
+       options->stack_size < (size_t)PTHREAD_STACK_MIN)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   int completion_fd = -1;
+   if (options->completion_queue)
+   {
+      completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (completion_fd < 0)
+         return TPOOL_ERR_IO;
+   }
+
+   struct thread_pool *new_pool = cache_aligned_malloc(sizeof(*new_pool));
+   new_pool->workers = cache_aligned_malloc(sizeof(struct pool_worker) *
+                                            max_thread_count);
+   new_pool->max_threads_count = max_thread_count;
+   if (!thread_pool_place_workers(new_pool, options))
+   {
+      if (completion_fd >= 0)
+         close(completion_fd);
+      cache_aligned_free(new_pool->workers);
+      cache_aligned_free(new_pool);
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   }
+   for (int i = 0; i < max_thread_count; i++)
+   {
+      struct pool_worker *worker = &new_pool->workers[i];
+      worker->pool = new_pool;
+      worker->slot_state = SLOT_FREE;
+      worker->steal_seed = 2463534242u + i * 2654435761u;
+      worker->spin_limit = WORKER_SPIN_MIN;
+      worker->run_depth = 0;
+      worker->park_state = WORKER_AWAKE;
+      worker->next_parked = NULL;
+      worker->pick_count = 0;
+      worker->free_fibers = NULL;
+      worker->free_fiber_count = 0;
+      worker->suspended_count = 0;
+      worker->slab_in_flight = 0;
+      worker->resumable = NULL;
+      memset(&worker->stats, 0, sizeof(worker->stats));
+      trace_ring_create(&worker->trace, options->trace_size);
+      for (int j = 0; j < TPOOL_PRIORITY_COUNT; j++)
+         task_deque_init(&worker->deques[j]);
+   }
+   new_pool->active_threads = 0;
+   new_pool->idle_timeout = options->idle_timeout;
+   new_pool->idle_threads = 0;
+   new_pool->workers_created = 0;
+   new_pool->workers_retired = 0;
+   memset(&new_pool->helper_stats, 0, sizeof(new_pool->helper_stats));
+   new_pool->tasks_count = 0;
+   new_pool->queued_count = 0;
+   for (int i = 0; i < TPOOL_PRIORITY_COUNT; i++)
+      new_pool->queued_counts[i] = 0;
+   new_pool->nodes = cache_aligned_malloc(sizeof(struct pool_node) *
+                                          new_pool->node_count);
+   for (int i = 0; i < new_pool->node_count; i++)
+   {
+      for (int j = 0; j < TPOOL_PRIORITY_COUNT; j++)
+         task_ring_create(&new_pool->nodes[i].rings[j], TPOOL_MAX_TASKS);
+   }
+   new_pool->next_deque = 0;
+   task_slab_create(&new_pool->slab);
+   new_pool->parked = NULL;
+   new_pool->parked_count = 0;
+   new_pool->is_shutdown = false;
+   new_pool->is_tracing = options->trace_size > 0;
+   trace_ring_create(&new_pool->trace, options->trace_size);
+   new_pool->trace_start = clock_monotonic_ns();
+   size_t page_size = sysconf(_SC_PAGESIZE);
+   new_pool->fiber_stack_size = (options->fiber_stack_size + page_size - 1) /
+                                page_size * page_size;
+   new_pool->stack_size = (options->stack_size + page_size - 1) /
+                          page_size * page_size;
+   new_pool->guard_size = options->guard_size;
+   new_pool->thread_name[0] = 0;
+   if (options->thread_name != NULL)
+   {
+      strncat(new_pool->thread_name, options->thread_name,
+              THREAD_NAME_PREFIX_MAX);
+   }
+   timer_wheel_create(&new_pool->timers);
+   pthread_mutex_init(&new_pool->push_mutex, NULL);
+   new_pool->push_waiters = NULL;
+   new_pool->push_waiters_tail = &new_pool->push_waiters;
+   new_pool->push_waiter_count = 0;
+   new_pool->idle_waiter_count = 0;
+   new_pool->unreserving_count = 0;
+   new_pool->completions.fd = completion_fd;
+   new_pool->completions.finished = NULL;
+   new_pool->completions.in_flight = 0;
+   pthread_mutex_init(&new_pool->completions.mutex, NULL);
+   new_pool->completions.ready = NULL;
+   new_pool->completions.ready_tail = &new_pool->completions.ready;
+   pthread_mutex_init(&new_pool->spawn_mutex, NULL);
+   pthread_mutex_init(&new_pool->park_mutex, NULL);
+   *pool = new_pool;
+   return 0;
+}
+
+int
+thread_pool_thread_count(const struct thread_pool *pool)
+{
+   return __atomic_load_n(&pool->active_threads, __ATOMIC_ACQUIRE);
+}
+
+int
+thread_pool_delete(struct thread_pool *pool)
+{
+   if (__atomic_load_n(&pool->tasks_count, __ATOMIC_SEQ_CST))
+      return TPOOL_ERR_HAS_TASKS;
+   /* The threads which took the last tasks out are leaving the pool */
+   while (__atomic_load_n(&pool->unreserving_count, __ATOMIC_ACQUIRE))
+      sched_yield();
+   /* The finished tasks are on the way to the completion queue or slab */
+   while (__atomic_load_n(&pool->completions.in_flight, __ATOMIC_ACQUIRE) ||
+          __atomic_load_n(&pool->slab.in_flight, __ATOMIC_ACQUIRE))
+      sched_yield();
+   for (int i = 0; i < pool->max_threads_count; i++)
+   {
+      while (__atomic_load_n(&pool->workers[i].slab_in_flight,
+                             __ATOMIC_ACQUIRE))
+         sched_yield();
+   }
+   if (__atomic_load_n(&pool->completions.finished, __ATOMIC_ACQUIRE) != NULL ||
+       pool->completions.ready != NULL)
+      return TPOOL_ERR_HAS_TASKS;
+   pthread_mutex_lock(&pool->slab.mutex);
+   int slab_used = pool->slab.used_count;
+   pthread_mutex_unlock(&pool->slab.mutex);
+   if (slab_used != 0)
+      return TPOOL_ERR_HAS_TASKS;
+   __atomic_store_n(&pool->is_shutdown, true, __ATOMIC_SEQ_CST);
+   thread_pool_wakeup(pool, pool->max_threads_count);
+   for (int i = 0; i < pool->max_threads_count; i++)
+   {
+      if (pool->workers[i].slot_state != SLOT_FREE)
+         pthread_join(pool->workers[i].thread, NULL);
+   }
+   for (int i = 0; i < pool->max_threads_count; i++)
+   {
+      for (int j = 0; j < TPOOL_PRIORITY_COUNT; j++)
+         pthread_mutex_destroy(&pool->workers[i].deques[j].mutex);
+      free(pool->workers[i].trace.events);
+   }
+   free(pool->trace.events);
+   for (int i = 0; i < pool->node_count; i++)
+   {
+      for (int j = 0; j < TPOOL_PRIORITY_COUNT; j++)
+         task_ring_destroy(&pool->nodes[i].rings[j]);
+   }
+   cache_aligned_free(pool->nodes);
+   free(pool->cpu_nodes);
+   timer_wheel_destroy(&pool->timers);
+   pthread_mutex_destroy(&pool->push_mutex);
+   if (pool->completions.fd >= 0)
+      close(pool->completions.fd);
+   pthread_mutex_destroy(&pool->completions.mutex);
+   task_slab_destroy(&pool->slab);
+   pthread_mutex_destroy(&pool->spawn_mutex);
+   pthread_mutex_destroy(&pool->park_mutex);
+   cache_aligned_free(pool->workers);
+   cache_aligned_free(pool);
+   return 0;
+}
+
+int
+thread_pool_wait_idle(struct thread_pool *pool, double timeout)
+{
+   /* The task would wait for itself */
+   if (current_task != NULL && current_task->pool == pool)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   uint64_t deadline = deadline_after(timeout);
+   /* Seen by thread_pool_unreserve() before it looks at the counter */
+   __atomic_add_fetch(&pool->idle_waiter_count, 1, __ATOMIC_SEQ_CST);
+   int count = __atomic_load_n(&pool->tasks_count, __ATOMIC_SEQ_CST);
+   int rc = 0;
+   while (count != 0)
+   {
+      uint64_t now = clock_monotonic_ns();
+      if (now >= deadline)
+      {
+         rc = TPOOL_ERR_TIMEOUT;
+         break;
+      }
+      /* Any other count makes the wait return right away */
+      struct timespec ts = timespec_from_ns(deadline - now);
+      futex_wait((uint32_t *)&pool->tasks_count, count, &ts);
+      count = __atomic_load_n(&pool->tasks_count, __ATOMIC_SEQ_CST);
+   }
+   __atomic_sub_fetch(&pool->idle_waiter_count, 1, __ATOMIC_SEQ_CST);
+   return rc;
+}
+
+int
+thread_pool_delete_wait(struct thread_pool *pool, double timeout)
+{
+   int rc = thread_pool_wait_idle(pool, timeout);
+   if (rc != 0)
+      return rc;
+   return thread_pool_delete(pool);
+}
 
-struct thread_task {
-	thread_task_f function;
-	void *arg;
+/*
+ * Counts the tasks accepted by a push, before they can finish, and takes
+ * back the failed ones. A worker of the pool counts on its own line, the
+ * other threads share the helper's counter.
+ */
+static void
+thread_pool_count_pushed(struct thread_pool *pool, int count)
+{
+   if (current_worker != NULL && current_worker->pool == pool)
+   {
+      uint64_t *counter = &current_worker->stats.tasks_pushed;
+      __atomic_store_n(counter,
+                       __atomic_load_n(counter, __ATOMIC_RELAXED) + count,
+                       __ATOMIC_RELAXED);
+   }
+   else
+   {
+      __atomic_add_fetch(&pool->helper_stats.tasks_pushed, count,
+                         __ATOMIC_RELAXED);
+   }
+}
 
-	/* PUT HERE OTHER MEMBERS */
-   struct thread_task *next;
-   struct thread_task *prev;
-   bool is_pushed;
-   bool is_running;
-   bool is_finished;
-   pthread_mutex_t mutex;
-   pthread_cond_t cond;
-   void *result;
-};
+/* Pushes a task already accounted in the pool by thread_pool_reserve() */
+static int
+thread_pool_push_reserved(struct thread_pool *pool, struct thread_task *task)
+{
+   thread_task_prepare_push(pool, task);
+   thread_pool_count_pushed(pool, 1);
+   /* The last of the unfinished predecessors will queue the task */
+   if (!task_release(task))
+      return 0;
+   if (!thread_pool_enqueue(pool, task))
+   {
+      thread_pool_count_pushed(pool, -1);
+      __atomic_store_n(&task->pending, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&task->state, TASK_STATE_NEW, __ATOMIC_RELEASE);
+      thread_pool_unreserve(pool, 1);
+      return TPOOL_ERR_TOO_MANY_TASKS;
+   }
+   thread_pool_grow(pool);
+   thread_pool_wakeup(pool, 1);
+   return 0;
+}
 
-struct thread_pool {
-	pthread_t *threads; // individual_stacks
+int
+thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+{
+   if (!thread_pool_reserve(pool, 1))
+      return TPOOL_ERR_TOO_MANY_TASKS;
+   return thread_pool_push_reserved(pool, task);
+}
 
-	/* PUT HERE OTHER MEMBERS */
-   int max_threads_count;
-   int active_threads;
-   struct thread_task *first_task;
-   struct thread_task *last_task;
-   int tasks_count;
-   pthread_mutex_t task_mutex;
-};
+int
+thread_pool_push_task_wait(struct thread_pool *pool, struct thread_task *task,
+                           double timeout)
+{
+   /* Do not overtake the producers waiting already */
+   bool is_reserved =
+      __atomic_load_n(&pool->push_waiter_count, __ATOMIC_SEQ_CST) == 0 &&
+      thread_pool_reserve(pool, 1);
+   if (!is_reserved && !thread_pool_wait_reserve(pool, timeout))
+      return TPOOL_ERR_TIMEOUT;
+   return thread_pool_push_reserved(pool, task);
+}
 
-/* Creates a task which will borrow other tasks from queue */
-void *
-init_pool_task(void *args)
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+                       int count)
 {
-   printf("started init_pool_task function\n");
-   struct thread_pool *pool = args;
-   pthread_mutex_lock(&pool->task_mutex);
-   pool->active_threads++;
-   while (pool->tasks_count > 0)
+   if (count < 0)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (count == 0)
+      return 0;
+   if (!thread_pool_reserve(pool, count))
+      return TPOOL_ERR_TOO_MANY_TASKS;
+   for (int i = 0; i < count; i++)
+      thread_task_prepare_push(pool, tasks[i]);
+   thread_pool_count_pushed(pool, count);
+
+   /*
+    * The whole batch lands in one worker's deques, idle workers spread it
+    * by stealing.
+    */
+   struct pool_worker *worker;
+   if (current_worker != NULL && current_worker->pool == pool)
    {
-      pool->tasks_count--;
-      if (pool->tasks_count > 0 && pool->active_threads + 1 <= pool->max_threads_count)
-         pthread_create(&pool->threads[pool->active_threads], NULL, &init_pool_task, args);
-      struct thread_task *curr_task = pool->first_task;
-      pthread_mutex_lock(&curr_task->mutex);
-      curr_task->result = curr_task->function(curr_task->arg);
-      printf("executed function in thread\n");
-      pthread_cond_signal(&curr_task->cond);
-      pthread_mutex_unlock(&curr_task->mutex);
-      pool->first_task = pool->first_task->next;
-      if (pool->first_task == NULL)
-         pool->last_task = NULL;
-      // maybe add another mutex in order to remove the following gap so that
-      // thread won't monopolize the processing time
-      pthread_mutex_unlock(&pool->task_mutex);
+      worker = current_worker;
+   }
+   else
+   {
+      /* Prefer a live owner, though thieves scan all deques anyway */
+      unsigned idx = __atomic_fetch_add(&pool->next_deque, 1,
+                                        __ATOMIC_RELAXED);
+      int id = idx % pool->max_threads_count;
+      for (int i = 0; i < pool->max_threads_count; i++)
+      {
+         int probe = (idx + i) % pool->max_threads_count;
+         if (__atomic_load_n(&pool->workers[probe].slot_state,
+                             __ATOMIC_RELAXED) == SLOT_ALIVE)
+         {
+            id = probe;
+            break;
+         }
+      }
+      worker = &pool->workers[id];
+   }
+   /* Split the batch into one chain per priority keeping the order */
+   struct thread_task *first[TPOOL_PRIORITY_COUNT] = {NULL};
+   struct thread_task *last[TPOOL_PRIORITY_COUNT] = {NULL};
+   int chain_size[TPOOL_PRIORITY_COUNT] = {0};
+   int ready_count = 0;
+   uint64_t now = clock_monotonic_ns();
+   for (int i = 0; i < count; i++)
+   {
+      struct thread_task *task = tasks[i];
+      /* Tasks with unfinished predecessors are queued by them later */
+      if (!task_release(task))
+         continue;
+      task->queued_at = now;
+      thread_pool_trace(pool, TRACE_PUSH, task);
+      int priority = task->priority;
+      task->prev = last[priority];
+      task->next = NULL;
+      if (last[priority] != NULL)
+         last[priority]->next = task;
+      else
+         first[priority] = task;
+      last[priority] = task;
+      chain_size[priority]++;
+      ready_count++;
+   }
+   for (int i = 0; i < TPOOL_PRIORITY_COUNT; i++)
+   {
+      if (first[i] != NULL)
+         task_deque_push_chain(pool, &worker->deques[i], first[i], last[i],
+                               chain_size[i]);
+   }
+   if (ready_count == 0)
+      return 0;
+   thread_pool_grow(pool);
+   thread_pool_wakeup(pool, ready_count);
+   return 0;
+}
 
-      pthread_mutex_lock(&pool->task_mutex);
+/* Pushes a task to be queued by the timer thread once it is due */
+static int
+thread_pool_push_timer(struct thread_pool *pool, struct thread_task *task,
+                       double delay, double period)
+{
+   if (!thread_pool_reserve(pool, 1))
+      return TPOOL_ERR_TOO_MANY_TASKS;
+   thread_task_prepare_push(pool, task);
+   task->period = (uint64_t)(period * 1e9);
+   /* What a periodic task cancelled before its first run joins with */
+   task->result = NULL;
+   task->due_at = clock_monotonic_ns() + (uint64_t)(delay * 1e9);
+   thread_pool_count_pushed(pool, 1);
+   if (!thread_pool_add_timer(pool, task))
+   {
+      thread_pool_count_pushed(pool, -1);
+      __atomic_store_n(&task->state, TASK_STATE_NEW, __ATOMIC_RELEASE);
+      thread_pool_unreserve(pool, 1);
+      return TPOOL_ERR_TOO_MANY_TASKS;
    }
-   pool->active_threads--;
-   pthread_mutex_unlock(&pool->task_mutex);
    return 0;
 }
 
 int
-thread_pool_new(int max_thread_count, struct thread_pool **pool)
+thread_pool_push_task_after(struct thread_pool *pool, struct thread_task *task,
+                            double delay)
 {
-	if (max_thread_count > TPOOL_MAX_THREADS || max_thread_count <= 0)
-      return TPOOL_ERR_INVALID_ARGUMENT;  
-   
-   *pool = malloc(sizeof(struct thread_pool));
-   (*pool)->threads = malloc(sizeof(pthread_t) * max_thread_count);
-   (*pool)->active_threads = 0;
-   (*pool)->tasks_count = 0;
-   (*pool)->max_threads_count = max_thread_count;
-   (*pool)->first_task = NULL;
-   (*pool)->last_task = NULL;
-   pthread_mutex_init(&(*pool)->task_mutex, NULL);
-   return 0; 
+   /* Much more than a year is a mistake and would overflow the clock */
+   if (!(delay >= 0 && delay < 1e9))
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   return thread_pool_push_timer(pool, task, delay, 0);
 }
 
 int
-thread_pool_thread_count(const struct thread_pool *pool)
+thread_pool_push_task_every(struct thread_pool *pool, struct thread_task *task,
+                            double period)
+{
+   if (!(period >= TIMER_TICK_NS / 1e9 && period < 1e9))
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   return thread_pool_push_timer(pool, task, period, period);
+}
+
+uint64_t
+thread_pool_task_alloc_count(struct thread_pool *pool)
+{
+   pthread_mutex_lock(&pool->slab.mutex);
+   uint64_t count = pool->slab.alloc_count;
+   pthread_mutex_unlock(&pool->slab.mutex);
+   return count;
+}
+
+void
+thread_pool_get_stats(const struct thread_pool *pool,
+                      struct thread_pool_stats *stats)
+{
+   memset(stats, 0, sizeof(*stats));
+   stats->queue_depth = __atomic_load_n(&pool->queued_count,
+                                        __ATOMIC_RELAXED);
+   if (stats->queue_depth < 0)
+      stats->queue_depth = 0;
+   stats->peak_queue_depth = stats->queue_depth;
+   for (int i = 0; i <= pool->max_threads_count; i++)
+   {
+      const struct worker_stats *ws = i < pool->max_threads_count ?
+                                      &pool->workers[i].stats :
+                                      &pool->helper_stats;
+      stats->tasks_pushed += __atomic_load_n(&ws->tasks_pushed,
+                                             __ATOMIC_RELAXED);
+      stats->tasks_completed += __atomic_load_n(&ws->tasks_completed,
+                                                __ATOMIC_RELAXED);
+      stats->tasks_cancelled += __atomic_load_n(&ws->tasks_cancelled,
+                                                __ATOMIC_RELAXED);
+      int peak = __atomic_load_n(&ws->peak_queue_depth, __ATOMIC_RELAXED);
+      if (peak > stats->peak_queue_depth)
+         stats->peak_queue_depth = peak;
+      for (int j = 0; j < TPOOL_STATS_BUCKETS; j++)
+      {
+         stats->wait_time_hist[j] += __atomic_load_n(&ws->wait_time_hist[j],
+                                                     __ATOMIC_RELAXED);
+         stats->run_time_hist[j] += __atomic_load_n(&ws->run_time_hist[j],
+                                                    __ATOMIC_RELAXED);
+      }
+   }
+   stats->workers_created = __atomic_load_n(&pool->workers_created,
+                                            __ATOMIC_RELAXED);
+   stats->workers_retired = __atomic_load_n(&pool->workers_retired,
+                                            __ATOMIC_RELAXED);
+}
+
+/* Writes one Chrome trace event, the fields after ph are in @a format */
+static void
+trace_dump_event(FILE *file, bool *is_first, const char *name,
+                 const char *ph, int tid, double ts, const char *format,
+                 uintptr_t task)
 {
-   return pool->active_threads;
+   fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":1,"
+           "\"tid\":%d,\"ts\":%.3f", *is_first ? "" : ",\n", name, ph, tid,
+           ts);
+   fprintf(file, format, task);
+   fprintf(file, "}");
+   *is_first = false;
+}
+
+static void
+trace_dump_ring(FILE *file, bool *is_first, const struct trace_ring *ring,
+                int tid, uint64_t start)
+{
+   uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+   uint64_t pos = head > ring->size ? head - ring->size : 0;
+   for (; pos < head; pos++)
+   {
+      struct trace_event event;
+      if (!trace_ring_read(ring, pos, &event))
+         continue;
+      double ts = event.time > start ? (event.time - start) / 1000.0 : 0;
+      uintptr_t task = event.task;
+      /* Flow arrows link the push of a task to its start */
+      switch (event.type)
+      {
+      case TRACE_PUSH:
+         trace_dump_event(file, is_first, "push", "i", tid, ts,
+                          ",\"s\":\"t\",\"args\":{\"task\":\"%#"
+                          PRIxPTR "\"}", task);
+         trace_dump_event(file, is_first, "task", "s", tid, ts,
+                          ",\"cat\":\"flow\",\"id\":\"%#" PRIxPTR "\"", task);
+         break;
+      case TRACE_START:
+         trace_dump_event(file, is_first, "task", "B", tid, ts,
+                          ",\"args\":{\"task\":\"%#" PRIxPTR "\"}",
+                          task);
+         trace_dump_event(file, is_first, "task", "f", tid, ts,
+                          ",\"cat\":\"flow\",\"bp\":\"e\",\"id\":\"%#"
+                          PRIxPTR "\"", task);
+         break;
+      case TRACE_FINISH:
+         trace_dump_event(file, is_first, "task", "E", tid, ts, "", task);
+         break;
+      case TRACE_STEAL:
+         trace_dump_event(file, is_first, "steal", "i", tid, ts,
+                          ",\"s\":\"t\",\"args\":{\"task\":\"%#"
+                          PRIxPTR "\"}", task);
+         break;
+      case TRACE_PARK:
+         trace_dump_event(file, is_first, "park", "B", tid, ts, "", task);
+         break;
+      case TRACE_WAKE:
+         trace_dump_event(file, is_first, "park", "E", tid, ts, "", task);
+         break;
+      /* A suspended task ends its slice, the resume starts a new one */
+      case TRACE_SUSPEND:
+         trace_dump_event(file, is_first, "task", "E", tid, ts,
+                          ",\"args\":{\"suspended\":true}", task);
+         break;
+      case TRACE_RESUME:
+         trace_dump_event(file, is_first, "task", "B", tid, ts,
+                          ",\"args\":{\"task\":\"%#" PRIxPTR "\","
+                          "\"resumed\":true}", task);
+         break;
+      }
+   }
 }
 
 int
-thread_pool_delete(struct thread_pool *pool)
+thread_pool_trace_dump(struct thread_pool *pool, const char *path)
 {
-   if (pool->tasks_count)
-      return TPOOL_ERR_HAS_TASKS;
-   free(pool->first_task);
-   free(pool->last_task);
-   free(pool->threads);
-   free(pool);
-   return 0;
+   if (!pool->is_tracing)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   FILE *file = fopen(path, "w");
+   if (file == NULL)
+      return TPOOL_ERR_IO;
+   bool is_first = true;
+   fprintf(file, "{\"traceEvents\":[\n");
+   /* Thread 0 stands for all the threads pushing from outside */
+   for (int tid = 0; tid <= pool->max_threads_count; tid++)
+   {
+      fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+              "\"tid\":%d,\"args\":{\"name\":\"", is_first ? "" : ",\n", tid);
+      if (tid == 0)
+         fprintf(file, "external\"}}");
+      else
+         fprintf(file, "worker %d\"}}", tid - 1);
+      is_first = false;
+      const struct trace_ring *ring = tid == 0 ? &pool->trace :
+                                      &pool->workers[tid - 1].trace;
+      trace_dump_ring(file, &is_first, ring, tid, pool->trace_start);
+   }
+   fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+   bool is_ok = !ferror(file);
+   if (fclose(file) != 0)
+      is_ok = false;
+   return is_ok ? 0 : TPOOL_ERR_IO;
 }
 
 int
-thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+thread_pool_queue_depth(const struct thread_pool *pool, int priority)
 {
-   printf("started thread_pool_push_task function\n");
-   pthread_mutex_lock(&pool->task_mutex);
-   if (pool->tasks_count == TPOOL_MAX_TASKS)
-      return TPOOL_ERR_TOO_MANY_TASKS;
-   pthread_mutex_lock(&task->mutex);
-   printf("gained task mutex\n");
-   task->is_pushed = true;
-   pthread_mutex_unlock(&task->mutex);
-   if (pool->first_task != NULL)
-      pool->last_task->next = task;
+   if (priority < 0 || priority >= TPOOL_PRIORITY_COUNT)
+      return 0;
+   int depth = __atomic_load_n(&pool->queued_counts[priority],
+                               __ATOMIC_ACQUIRE);
+   /* A ring pop can be accounted before the push it raced with */
+   return depth > 0 ? depth : 0;
+}
+
+int
+thread_pool_completion_fd(const struct thread_pool *pool)
+{
+   return pool->completions.fd;
+}
+
+int
+thread_pool_reap_completed(struct thread_pool *pool,
+                           struct thread_task **tasks, int max)
+{
+   struct completion_queue *queue = &pool->completions;
+   if (queue->fd < 0 || max <= 0)
+      return 0;
+   pthread_mutex_lock(&queue->mutex);
+   /*
+    * Reset the eventfd before taking the stack. A task pushed after
+    * that makes it readable again, so no completion goes unnoticed.
+    */
+   uint64_t value;
+   ssize_t rc = read(queue->fd, &value, sizeof(value));
+   (void)rc;
+   struct thread_task *stack = __atomic_exchange_n(&queue->finished, NULL,
+                                                   __ATOMIC_ACQUIRE);
+   /* The stack is newest first, append it to the ready ones reversed */
+   struct thread_task *batch = NULL;
+   struct thread_task **batch_tail = &batch;
+   bool is_tail_set = false;
+   while (stack != NULL)
+   {
+      struct thread_task *next = stack->group_next;
+      stack->group_next = batch;
+      if (!is_tail_set)
+      {
+         batch_tail = &stack->group_next;
+         is_tail_set = true;
+      }
+      batch = stack;
+      stack = next;
+   }
+   if (batch != NULL)
+   {
+      *queue->ready_tail = batch;
+      queue->ready_tail = batch_tail;
+   }
+   int count = 0;
+   while (count < max && queue->ready != NULL)
+   {
+      struct thread_task *task = queue->ready;
+      queue->ready = task->group_next;
+      /* The task can be joined now */
+      __atomic_and_fetch(&task->state, ~TASK_FLAG_COMPLETION,
+                         __ATOMIC_RELEASE);
+      tasks[count++] = task;
+   }
+   if (queue->ready == NULL)
+   {
+      queue->ready_tail = &queue->ready;
+   }
    else
-      pool->first_task = task;
-   pool->last_task = task;
-   if (!pool->active_threads)
    {
-      pthread_mutex_unlock(&pool->task_mutex);
-      printf("before pthread creation\n");
-      pthread_create(&pool->threads[pool->active_threads], NULL, &init_pool_task, &pool);
-   } else
-      pthread_mutex_unlock(&pool->task_mutex);
-   return 0;
+      /* Keep the loop coming back for the rest */
+      completion_queue_signal(queue);
+   }
+   pthread_mutex_unlock(&queue->mutex);
+   return count;
+}
+
+static void
+thread_task_init(struct thread_task *task, thread_task_f function, void *arg)
+{
+   task->function = function;
+   task->arg = arg;
+   task->next = NULL;
+   task->prev = NULL;
+   task->deque = NULL;
+   task->ring_cell = NULL;
+   task->timer_slot = NULL;
+   task->period = 0;
+   task->priority = TPOOL_PRIORITY_NORMAL;
+   task->state = TASK_STATE_NEW;
+   task->result = NULL;
+   task->pool = NULL;
+   task->successors = NULL;
+   task->pending = 1;
+   task->group = NULL;
+   task->group_next = NULL;
+   task->fiber = NULL;
+   task->is_internal = false;
 }
 
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
 {
-	*task = malloc(sizeof(struct thread_task*));
-   (*task)->function = function;
-   (*task)->arg = arg;
-   (*task)->next = NULL;
-   (*task)->is_pushed = false;
-   (*task)->is_running = false;
-   (*task)->is_finished = false;
-   (*task)->result = NULL;
-   pthread_cond_init(&(*task)->cond, NULL);
-   pthread_mutex_init(&(*task)->mutex, NULL);
+	*task = cache_aligned_malloc(sizeof(struct thread_task));
+   (*task)->slab = NULL;
+   thread_task_init(*task, function, arg);
+   return 0;
+}
+
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+                     thread_task_f function, void *arg)
+{
+   *task = task_slab_alloc(&pool->slab);
+   thread_task_init(*task, function, arg);
+   return 0;
+}
+
+int
+thread_task_new_inline(struct thread_task **task, thread_task_f function,
+                       const void *arg, size_t size)
+{
+   if (size > TPOOL_TASK_INLINE_SIZE)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   thread_task_new(task, function, NULL);
+   memcpy((*task)->payload, arg, size);
+   (*task)->arg = (*task)->payload;
+   return 0;
+}
+
+int
+thread_pool_task_new_inline(struct thread_pool *pool,
+                            struct thread_task **task, thread_task_f function,
+                            const void *arg, size_t size)
+{
+   if (size > TPOOL_TASK_INLINE_SIZE)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   thread_pool_task_new(pool, task, function, NULL);
+   memcpy((*task)->payload, arg, size);
+   (*task)->arg = (*task)->payload;
+   return 0;
+}
+
+void *
+thread_task_inline_data(struct thread_task *task)
+{
+   return task->payload;
+}
+
+int
+thread_task_set_priority(struct thread_task *task, int priority)
+{
+   if (priority < 0 || priority >= TPOOL_PRIORITY_COUNT)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (task_state(task) != TASK_STATE_NEW)
+      return TPOOL_ERR_TASK_IN_POOL;
+   task->priority = priority;
+   return 0;
+}
+
+int
+thread_task_then(struct thread_task *parent, struct thread_task *child)
+{
+   if (parent == child)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (task_state(child) != TASK_STATE_NEW)
+      return TPOOL_ERR_TASK_IN_POOL;
+   struct task_edge *edge = malloc(sizeof(*edge));
+   edge->task = child;
+   /* The child is not pushed yet, so this can't make it ready */
+   __atomic_add_fetch(&child->pending, 1, __ATOMIC_ACQ_REL);
+   struct task_edge *head = __atomic_load_n(&parent->successors,
+                                            __ATOMIC_ACQUIRE);
+   do
+   {
+      if (head == TASK_EDGES_CLOSED)
+      {
+         /* The parent is finished already, nothing to wait for */
+         task_release(child);
+         free(edge);
+         return 0;
+      }
+      edge->next = head;
+   } while (!__atomic_compare_exchange_n(&parent->successors, &head, edge,
+                                         true, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE));
    return 0;
 }
 
 bool
 thread_task_is_finished(const struct thread_task *task)
 {
-	return task->is_finished;
+	return task_state(task) == TASK_STATE_FINISHED;
 }
 
 bool
 thread_task_is_running(const struct thread_task *task)
 {
-	return task->is_running;
+	return task_state(task) == TASK_STATE_RUNNING;
+}
+
+/* Lets the peak queue depth see a task taken by a joining thread */
+static void
+thread_pool_note_joiner_take(struct thread_pool *pool)
+{
+   int depth = __atomic_load_n(&pool->queued_count, __ATOMIC_RELAXED) + 1;
+   int peak = __atomic_load_n(&pool->helper_stats.peak_queue_depth,
+                              __ATOMIC_RELAXED);
+   while (depth > peak &&
+          !__atomic_compare_exchange_n(&pool->helper_stats.peak_queue_depth,
+                                       &peak, depth, true, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED));
+}
+
+/*
+ * Takes a queued task back out of its queue, so the joiner can run it
+ * right away. Returns false if the task is not in a queue or a worker
+ * was faster.
+ */
+static bool
+thread_task_claim(struct thread_task *task)
+{
+   struct thread_pool *pool = task->pool;
+   struct task_deque *deque = __atomic_load_n(&task->deque,
+                                              __ATOMIC_RELAXED);
+   if (deque != NULL)
+   {
+      bool is_claimed = false;
+      pthread_mutex_lock(&deque->mutex);
+      if (task->deque == deque)
+      {
+         task_deque_unlink(pool, deque, task);
+         is_claimed = true;
+      }
+      pthread_mutex_unlock(&deque->mutex);
+      if (is_claimed)
+         thread_pool_note_joiner_take(pool);
+      return is_claimed;
+   }
+   /* A stale cell holds another task or nothing, then the take fails */
+   struct task_ring_cell *cell = __atomic_load_n(&task->ring_cell,
+                                                 __ATOMIC_RELAXED);
+   if (cell == NULL || !task_ring_take(cell, task))
+      return false;
+   thread_pool_count_queued(pool, task->priority, -1);
+   thread_pool_note_joiner_take(pool);
+   return true;
+}
+
+/*
+ * Takes any queued task for a joining thread. A worker of the pool looks
+ * the usual way, others go through the levels from the highest one and
+ * take from the rings first, then from the workers' deques.
+ */
+static struct thread_task *
+thread_pool_get_task_for_joiner(struct thread_pool *pool)
+{
+   if (current_worker != NULL && current_worker->pool == pool)
+      return worker_get_task(current_worker);
+   for (int priority = TPOOL_PRIORITY_COUNT - 1;
+        priority >= TPOOL_PRIORITY_LOW; priority--)
+   {
+      if (__atomic_load_n(&pool->queued_counts[priority],
+                          __ATOMIC_RELAXED) <= 0)
+         continue;
+      for (int i = 0; i < pool->node_count; i++)
+      {
+         struct thread_task *task =
+            task_ring_pop(&pool->nodes[i].rings[priority]);
+         if (task != NULL)
+         {
+            thread_pool_count_queued(pool, priority, -1);
+            thread_pool_note_joiner_take(pool);
+            return task;
+         }
+      }
+      for (int i = 0; i < pool->max_threads_count; i++)
+      {
+         struct thread_task *task =
+            task_deque_steal(pool, &pool->workers[i].deques[priority]);
+         if (task != NULL)
+         {
+            thread_pool_note_joiner_take(pool);
+            return task;
+         }
+      }
+   }
+   return NULL;
+}
+
+/*
+ * Runs the awaited task on the joining thread if it is still queued, or
+ * other queued tasks until it is finished. This way a task joining its
+ * subtasks can not deadlock the pool by occupying all the workers.
+ */
+static void
+thread_task_help(struct thread_task *task)
+{
+   struct thread_pool *pool = task->pool;
+   /*
+    * Keep the pool from being deleted while a thread from outside of it
+    * looks into the queues, like thread_pool_push_released() does.
+    */
+   bool is_foreign = current_worker == NULL || current_worker->pool != pool;
+   if (is_foreign)
+      __atomic_add_fetch(&pool->tasks_count, 1, __ATOMIC_SEQ_CST);
+   while (true)
+   {
+      uint32_t state = task_state(task);
+      if (state == TASK_STATE_QUEUED && thread_task_claim(task))
+      {
+         thread_pool_run_task(pool, task);
+         break;
+      }
+      if (state == TASK_STATE_FINISHED)
+         break;
+      struct thread_task *other = thread_pool_get_task_for_joiner(pool);
+      if (other == NULL)
+         break;
+      thread_pool_run_task(pool, other);
+   }
+   if (is_foreign)
+      thread_pool_unreserve(pool, 1);
 }
 
 int
 thread_task_join(struct thread_task *task, void **result)
 {
-   printf("started thread_task_join function\n");
-   pthread_mutex_lock(&task->mutex);
-   if (!task->is_pushed)
-   {
-      pthread_mutex_unlock(&task->mutex);
+   uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+   if ((state & TASK_STATE_MASK) == TASK_STATE_NEW)
       return TPOOL_ERR_TASK_NOT_PUSHED;
+   /* The group or the completion queue hands the task out when finished */
+   if (task->group != NULL || (state & TASK_FLAG_COMPLETION))
+      return TPOOL_ERR_TASK_IN_POOL;
+   if ((state & TASK_STATE_MASK) != TASK_STATE_FINISHED)
+   {
+      /* A fiber gives the worker to other tasks instead of helping */
+      if (current_fiber == NULL || !task_fiber_await(task))
+         thread_task_help(task);
+      state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+   }
+   while ((state & TASK_STATE_MASK) != TASK_STATE_FINISHED)
+   {
+      /* Let the worker know it has to wake someone up */
+      uint32_t waiting = state | TASK_FLAG_WAITERS;
+      if (state == waiting ||
+          __atomic_compare_exchange_n(&task->state, &state, waiting, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+         futex_wait(&task->state, waiting, NULL);
+      state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
    }
-   while (!task->is_finished)
-      pthread_cond_wait(&task->cond, &task->mutex);
    *result = task->result;
-   pthread_mutex_unlock(&task->mutex);
-   printf("unlocked task mutex in task_join\n");
+   /* The task can be a predecessor again once it is pushed anew */
+   __atomic_store_n(&task->successors, NULL, __ATOMIC_RELAXED);
+   __atomic_store_n(&task->state, TASK_STATE_NEW, __ATOMIC_RELEASE);
+   return (state & TASK_FLAG_CANCELLED) ? TPOOL_ERR_TASK_CANCELLED : 0;
+}
+
+int
+thread_task_cancel(struct thread_task *task)
+{
+   uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+   do
+   {
+      switch (state & TASK_STATE_MASK)
+      {
+      case TASK_STATE_NEW:
+         return TPOOL_ERR_TASK_NOT_PUSHED;
+      case TASK_STATE_FINISHED:
+         return TPOOL_ERR_TASK_STARTED;
+      }
+   } while (!__atomic_compare_exchange_n(&task->state, &state,
+                                         state | TASK_FLAG_CANCEL_REQUESTED,
+                                         true, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE));
+   if ((state & TASK_STATE_MASK) == TASK_STATE_RUNNING)
+      return TPOOL_ERR_TASK_STARTED;
+   /*
+    * Whoever starts the task now finishes it right away. Taken out of
+    * the queue, it does not wait for a worker to get to it. Otherwise a
+    * worker has it already, or its predecessors are not finished.
+    */
+   if (thread_task_claim(task))
+   {
+      thread_pool_run_task(task->pool, task);
+   }
+   else if (thread_pool_remove_timer(task->pool, task))
+   {
+      /* Due now, but the last predecessor still releases it as usual */
+      if (task_release(task))
+         thread_pool_run_task(task->pool, task);
+   }
    return 0;
 }
 
+bool
+thread_task_is_cancel_requested(void)
+{
+   return current_task != NULL &&
+          (__atomic_load_n(&current_task->state, __ATOMIC_RELAXED) &
+           TASK_FLAG_CANCEL_REQUESTED);
+}
+
 #if NEED_TIMED_JOIN
 
 int
@@ -191,9 +3489,16 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 int
 thread_task_delete(struct thread_task *task)
 {
-	if (task->is_pushed)
+	if (task_state(task) != TASK_STATE_NEW)
+      return TPOOL_ERR_TASK_IN_POOL;
+   /* Still waited for by one of its predecessors */
+   if (__atomic_load_n(&task->pending, __ATOMIC_ACQUIRE) > 1)
       return TPOOL_ERR_TASK_IN_POOL;
-   free(task);
+   /* The tasks waiting for this one do not have to anymore */
+   task_release_successors(task, NULL);
+   if (task->group != NULL)
+      task_group_leave(task->group);
+   thread_task_destroy(task);
    return 0;
 }
 
@@ -202,9 +3507,376 @@ thread_task_delete(struct thread_task *task)
 int
 thread_task_detach(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+   /* The group owns its members, see thread_task_group_new() */
+   if (task->group != NULL)
+      return TPOOL_ERR_TASK_IN_POOL;
+   uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+   /* It is reported by the completion queue, which has to stay valid */
+   if (state & TASK_FLAG_COMPLETION)
+      return TPOOL_ERR_TASK_IN_POOL;
+   do
+   {
+      switch (state & TASK_STATE_MASK)
+      {
+      case TASK_STATE_NEW:
+         return TPOOL_ERR_TASK_NOT_PUSHED;
+      case TASK_STATE_FINISHED:
+         thread_task_destroy(task);
+         return 0;
+      }
+      /* The worker finishing the task will delete it */
+   } while (!__atomic_compare_exchange_n(&task->state, &state,
+                                         state | TASK_FLAG_DETACHED, true,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+   return 0;
 }
 
 #endif
+
+int
+thread_task_group_new(struct thread_task_group **group, bool is_auto_delete)
+{
+   struct thread_task_group *new_group = malloc(sizeof(*new_group));
+   new_group->unfinished = 0;
+   new_group->is_auto_delete = is_auto_delete;
+   new_group->finished = NULL;
+   pthread_mutex_init(&new_group->mutex, NULL);
+   new_group->ready = NULL;
+   *group = new_group;
+   return 0;
+}
+
+int
+thread_task_group_delete(struct thread_task_group *group)
+{
+   if ((__atomic_load_n(&group->unfinished, __ATOMIC_ACQUIRE) &
+        ~GROUP_FLAGS) != 0 ||
+       __atomic_load_n(&group->finished, __ATOMIC_ACQUIRE) != NULL ||
+       group->ready != NULL)
+      return TPOOL_ERR_HAS_TASKS;
+   pthread_mutex_destroy(&group->mutex);
+   free(group);
+   return 0;
+}
+
+int
+thread_task_group_add(struct thread_task_group *group,
+                      struct thread_task *task)
+{
+   if (task_state(task) != TASK_STATE_NEW)
+      return TPOOL_ERR_TASK_IN_POOL;
+   if (task->group != NULL)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   task->group = group;
+   __atomic_add_fetch(&group->unfinished, 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+/* Lets the owner join the members finished so far */
+static void
+task_group_release_finished(struct thread_task_group *group)
+{
+   pthread_mutex_lock(&group->mutex);
+   struct thread_task *task = __atomic_exchange_n(&group->finished, NULL,
+                                                  __ATOMIC_ACQUIRE);
+   while (task != NULL)
+   {
+      struct thread_task *next = task->group_next;
+      task->group = NULL;
+      task = next;
+   }
+   for (task = group->ready; task != NULL; task = task->group_next)
+      task->group = NULL;
+   group->ready = NULL;
+   pthread_mutex_unlock(&group->mutex);
+}
+
+int
+thread_task_group_wait_all(struct thread_task_group *group, double timeout)
+{
+   uint64_t deadline = deadline_after(timeout);
+   uint32_t count = __atomic_load_n(&group->unfinished, __ATOMIC_ACQUIRE);
+   while ((count & ~GROUP_FLAGS) != 0)
+   {
+      uint64_t now = clock_monotonic_ns();
+      if (now >= deadline)
+         return TPOOL_ERR_TIMEOUT;
+      /* The flag is never cleared, a waiter might be sleeping yet */
+      uint32_t waiting = count | GROUP_FLAG_WAITERS;
+      if (count == waiting ||
+          __atomic_compare_exchange_n(&group->unfinished, &count, waiting,
+                                      false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE))
+      {
+         struct timespec ts = timespec_from_ns(deadline - now);
+         futex_wait(&group->unfinished, waiting, &ts);
+      }
+      count = __atomic_load_n(&group->unfinished, __ATOMIC_ACQUIRE);
+   }
+   if (!group->is_auto_delete)
+      task_group_release_finished(group);
+   return 0;
+}
+
+int
+thread_task_group_wait_any(struct thread_task_group *group,
+                           struct thread_task **task)
+{
+   if (group->is_auto_delete)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   pthread_mutex_lock(&group->mutex);
+   while (group->ready == NULL)
+   {
+      /*
+       * Members are pushed to the stack before they leave the counter.
+       * So if the stack is empty after the counter is read, the next
+       * finish changes the counter and can not be missed.
+       */
+      uint32_t count = __atomic_load_n(&group->unfinished, __ATOMIC_ACQUIRE);
+      group->ready = __atomic_exchange_n(&group->finished, NULL,
+                                         __ATOMIC_ACQUIRE);
+      if (group->ready != NULL)
+         break;
+      if ((count & ~GROUP_FLAGS) == 0)
+      {
+         pthread_mutex_unlock(&group->mutex);
+         return TPOOL_ERR_INVALID_ARGUMENT;
+      }
+      /*
+       * The mutex makes this the only such waiter, so the flag can be
+       * cleared after it wakes up.
+       */
+      uint32_t waiting = count | GROUP_FLAG_ANY_WAITERS;
+      if (count == waiting ||
+          __atomic_compare_exchange_n(&group->unfinished, &count, waiting,
+                                      false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE))
+      {
+         futex_wait(&group->unfinished, waiting, NULL);
+         __atomic_and_fetch(&group->unfinished, ~GROUP_FLAG_ANY_WAITERS,
+                            __ATOMIC_RELAXED);
+      }
+   }
+   *task = group->ready;
+   group->ready = (*task)->group_next;
+   (*task)->group = NULL;
+   pthread_mutex_unlock(&group->mutex);
+   return 0;
+}
+
+enum {
+   /*
+    * Upper bound on the pieces a parallel loop is cut into. Plenty for
+    * balancing TPOOL_MAX_THREADS workers and keeps the bookkeeping small.
+    */
+   PARALLEL_MAX_CHUNKS = 4096,
+};
+
+struct parallel_job;
+
+/* Chunks [lo, hi) of a parallel loop handed to a task */
+struct parallel_range {
+   struct parallel_job *job;
+   /* Set once the task is pushed, or failed to be pushed */
+   struct thread_task *task;
+   /* Whether the task made it to the pool, set before the task */
+   bool is_pushed;
+   int lo;
+   int hi;
+};
+
+/*
+ * A parallel loop cut into chunks of grain indexes. A task covering
+ * several chunks pushes its right half as a new task and keeps splitting
+ * the left one, so idle workers can steal big pieces while the owner
+ * works on small ones.
+ */
+struct parallel_job {
+   struct thread_pool *pool;
+   int64_t begin;
+   int64_t end;
+   int64_t grain;
+   thread_pool_for_f for_fn;
+   thread_pool_reduce_f reduce_fn;
+   void *ctx;
+   /* One partial result per chunk for a reduction, NULL for a loop */
+   char *partials;
+   size_t partial_stride;
+   /* All the pushed ranges, at most one less than chunks */
+   struct parallel_range *ranges;
+   int range_count;
+};
+
+static void
+parallel_run_chunks(struct parallel_job *job, int lo, int hi)
+{
+   for (int i = lo; i < hi; i++)
+   {
+      int64_t begin = job->begin + i * job->grain;
+      int64_t end = job->end - begin > job->grain ? begin + job->grain :
+                                                    job->end;
+      if (job->partials != NULL)
+         job->reduce_fn(begin, end, job->partials + i * job->partial_stride,
+                        job->ctx);
+      else
+         job->for_fn(begin, end, job->ctx);
+   }
+}
+
+static void *
+parallel_range_f(void *arg);
+
+static void
+parallel_run(struct parallel_job *job, int lo, int hi)
+{
+   while (hi - lo > 1)
+   {
+      int mid = lo + (hi - lo) / 2;
+      int idx = __atomic_fetch_add(&job->range_count, 1, __ATOMIC_RELAXED);
+      struct parallel_range *range = &job->ranges[idx];
+      range->job = job;
+      range->lo = mid;
+      range->hi = hi;
+      struct thread_task *task;
+      thread_pool_task_new(job->pool, &task, parallel_range_f, range);
+      task->is_internal = true;
+      range->is_pushed = thread_pool_push_task(job->pool, task) == 0;
+      __atomic_store_n(&range->task, task, __ATOMIC_RELEASE);
+      /* The pool is full, do the rest right here */
+      if (!range->is_pushed)
+      {
+         parallel_run_chunks(job, lo, hi);
+         return;
+      }
+      hi = mid;
+   }
+   parallel_run_chunks(job, lo, hi);
+}
+
+static void *
+parallel_range_f(void *arg)
+{
+   struct parallel_range *range = arg;
+   parallel_run(range->job, range->lo, range->hi);
+   return NULL;
+}
+
+/*
+ * Waits for a piece of the loop and deletes its task. The join runs the
+ * piece right here if no worker has taken it yet. A failed join is
+ * returned, but only once the piece is over, as it uses the job.
+ */
+static int
+parallel_wait(struct parallel_range *range)
+{
+   int rc = 0;
+   if (range->is_pushed)
+   {
+      void *result;
+      rc = thread_task_join(range->task, &result);
+      while (rc != 0 && !thread_task_is_finished(range->task))
+         sched_yield();
+   }
+   thread_task_delete(range->task);
+   return rc;
+}
+
+/*
+ * Validates the loop bounds and picks the grain keeping the number of
+ * chunks in bounds. Returns the number of chunks, -1 on bad arguments.
+ */
+static int
+parallel_job_prepare(struct parallel_job *job)
+{
+   if (job->begin > job->end || job->grain < 0)
+      return -1;
+   int64_t size = job->end - job->begin;
+   int64_t min_grain = (size + PARALLEL_MAX_CHUNKS - 1) / PARALLEL_MAX_CHUNKS;
+   if (job->grain == 0)
+      job->grain = size / (job->pool->max_threads_count * 8);
+   if (job->grain < min_grain)
+      job->grain = min_grain;
+   if (job->grain == 0)
+      job->grain = 1;
+   return (size + job->grain - 1) / job->grain;
+}
+
+static int
+parallel_job_run(struct parallel_job *job, int chunk_count)
+{
+   int rc = 0;
+   job->ranges = calloc(chunk_count, sizeof(struct parallel_range));
+   job->range_count = 0;
+   /* The calling thread takes the first chunk */
+   parallel_run(job, 0, chunk_count);
+   /*
+    * Only running tasks push new ranges, so once all the ranges known so
+    * far are done, there are no more of them.
+    */
+   for (int i = 0; i < __atomic_load_n(&job->range_count, __ATOMIC_ACQUIRE);
+        i++)
+   {
+      while (__atomic_load_n(&job->ranges[i].task, __ATOMIC_ACQUIRE) == NULL)
+         sched_yield();
+      int wait_rc = parallel_wait(&job->ranges[i]);
+      if (rc == 0)
+         rc = wait_rc;
+   }
+   free(job->ranges);
+   return rc;
+}
+
+int
+thread_pool_parallel_for(struct thread_pool *pool, int64_t begin, int64_t end,
+                         int64_t grain, thread_pool_for_f fn, void *ctx)
+{
+   struct parallel_job job = {
+      .pool = pool,
+      .begin = begin,
+      .end = end,
+      .grain = grain,
+      .for_fn = fn,
+      .ctx = ctx,
+   };
+   int chunk_count = parallel_job_prepare(&job);
+   if (chunk_count < 0)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (chunk_count == 0)
+      return 0;
+   return parallel_job_run(&job, chunk_count);
+}
+
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, int64_t begin,
+                            int64_t end, int64_t grain,
+                            thread_pool_reduce_f fn,
+                            thread_pool_combine_f combine, void *ctx,
+                            void *result, size_t result_size)
+{
+   struct parallel_job job = {
+      .pool = pool,
+      .begin = begin,
+      .end = end,
+      .grain = grain,
+      .reduce_fn = fn,
+      .ctx = ctx,
+   };
+   int chunk_count = parallel_job_prepare(&job);
+   if (chunk_count < 0 || result_size == 0)
+      return TPOOL_ERR_INVALID_ARGUMENT;
+   if (chunk_count == 0)
+      return 0;
+   /* Partial results of a reduction do not share cache lines */
+   job.partial_stride = (result_size + CACHE_LINE_SIZE - 1) /
+                        CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+   job.partials = cache_aligned_malloc(job.partial_stride * chunk_count);
+   /* Each chunk starts from the identity value passed in the result */
+   for (int i = 0; i < chunk_count; i++)
+      memcpy(job.partials + i * job.partial_stride, result, result_size);
+   int rc = parallel_job_run(&job, chunk_count);
+   /* Combine in the index order, so the operation needs no commutativity */
+   for (int i = 0; rc == 0 && i < chunk_count; i++)
+      combine(result, job.partials + i * job.partial_stride, ctx);
+   cache_aligned_free(job.partials);
+   return rc;
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -15,17 +17,20 @@
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
-#define NEED_DETACH 0
+#define NEED_DETACH 1
 #define NEED_TIMED_JOIN 0
 
 struct thread_pool;
 struct thread_task;
+struct thread_task_group;
 
 typedef void *(*thread_task_f)(void *);
 
 enum {
 	TPOOL_MAX_THREADS = 20,
 	TPOOL_MAX_TASKS = 100000,
+	/** Bytes of argument and result stored right in a task. */
+	TPOOL_TASK_INLINE_SIZE = 48,
 };
 
 enum thread_poool_errcode {
@@ -36,6 +41,20 @@ enum thread_poool_errcode {
 	TPOOL_ERR_TASK_IN_POOL,
 	TPOOL_ERR_NOT_IMPLEMENTED,
 	TPOOL_ERR_TIMEOUT,
+	TPOOL_ERR_IO,
+	TPOOL_ERR_TASK_CANCELLED,
+	TPOOL_ERR_TASK_STARTED,
+};
+
+/**
+ * Task priority levels. Workers run the tasks of higher levels
+ * first, though lower ones are never starved completely.
+ */
+enum thread_task_priority {
+	TPOOL_PRIORITY_LOW = 0,
+	TPOOL_PRIORITY_NORMAL,
+	TPOOL_PRIORITY_HIGH,
+	TPOOL_PRIORITY_COUNT,
 };
 
 /** Thread pool API. */
@@ -54,9 +73,127 @@ enum thread_poool_errcode {
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
+/** How the workers of a pool are placed on CPUs. */
+enum thread_pool_affinity {
+	/** Workers are not pinned, the OS moves them freely. */
+	TPOOL_AFFINITY_NONE = 0,
+	/**
+	 * Each worker is pinned to its own CPU, the CPUs of one NUMA
+	 * node are taken before the next node.
+	 */
+	TPOOL_AFFINITY_COMPACT,
+	/**
+	 * Each worker is pinned to its own CPU, the NUMA nodes are
+	 * taken in turn.
+	 */
+	TPOOL_AFFINITY_ROUND_ROBIN,
+};
+
+/** Thread pool creation parameters. */
+struct thread_pool_options {
+	/** Maximum pool size. */
+	int max_thread_count;
+	/**
+	 * How many seconds a worker without tasks waits for new ones
+	 * before exiting. The pool starts it again when needed. 0 or
+	 * infinity means workers never exit on their own.
+	 */
+	double idle_timeout;
+	/**
+	 * One of enum thread_pool_affinity. Pinned workers are grouped
+	 * by NUMA nodes. Tasks pushed from a node's CPU are queued on
+	 * that node, and workers take tasks from other nodes only
+	 * when their own node has none.
+	 */
+	int affinity;
+	/**
+	 * CPUs to pin the workers to, in the order of use, each one
+	 * once. NULL means all the CPUs the process can run on. When
+	 * there are fewer CPUs than workers, several workers share a
+	 * CPU.
+	 */
+	const int *cpus;
+	/** Number of CPUs in @a cpus. */
+	int cpu_count;
+	/**
+	 * How many latest events each worker keeps for
+	 * thread_pool_trace_dump(). 0 turns tracing off, then it
+	 * costs nothing but a branch.
+	 */
+	int trace_size;
+	/**
+	 * Put the finished tasks into a completion queue read by
+	 * thread_pool_reap_completed(), for event loops which can not
+	 * block in a join. Its eventfd, thread_pool_completion_fd(),
+	 * is readable while the queue is not empty. The tasks can be
+	 * joined only after they are reaped. Group members are not
+	 * queued, their group reports them.
+	 */
+	bool completion_queue;
+	/**
+	 * Run the tasks on fibers with stacks of this many bytes,
+	 * rounded up to pages. A task joining another one inside a
+	 * fiber is suspended and its worker runs other tasks, so many
+	 * more tasks can wait at once than there are threads. The
+	 * stack pages are committed only when used. 0 runs the tasks
+	 * right on the worker stacks, then a join inside a task
+	 * helps with other tasks instead.
+	 */
+	size_t fiber_stack_size;
+	/**
+	 * Stack size of the pool's threads in bytes, rounded up to
+	 * pages. 0 means the system default, usually 8 MB. The pages
+	 * are committed only when used, but the whole size is
+	 * reserved in the address space.
+	 */
+	size_t stack_size;
+	/**
+	 * Size of the guard area below each thread stack. 0 means
+	 * the system default of one page.
+	 */
+	size_t guard_size;
+	/**
+	 * Prefix of the thread names, up to 10 characters are used.
+	 * The workers are named "<prefix>-<number>", the timer thread
+	 * "<prefix>-timer". NULL leaves the threads unnamed.
+	 */
+	const char *thread_name;
+};
+
+/**
+ * Fill @a options with the defaults: TPOOL_MAX_THREADS not
+ * pinned threads named "tpool-N" with the default stacks, which
+ * never exit while the pool exists.
+ * @param[out] options Options to initialize.
+ */
+void
+thread_pool_options_init(struct thread_pool_options *options);
+
+/**
+ * Create a new thread pool configured by @a options. The options
+ * should be initialized with thread_pool_options_init() first.
+ * @param options Pool parameters.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is too big,
+ *       or 0, or idle_timeout is negative or NaN, or affinity is
+ *       unknown, or cpus has a CPU the process can not run on or the
+ *       same CPU twice, or cpu_count is over CPU_SETSIZE, or
+ *       trace_size is negative, or fiber_stack_size is not 0
+ *       and smaller than 16 KB, or stack_size is not 0 and
+ *       smaller than PTHREAD_STACK_MIN.
+ *     - TPOOL_ERR_IO - the completion queue eventfd can't be
+ *       created.
+ */
+int
+thread_pool_new_ex(const struct thread_pool_options *options,
+		   struct thread_pool **pool);
+
 /**
- * How many threads are created by this pool. Can be less than
- * max.
+ * How many threads are created by this pool and did not exit.
+ * Can be less than max.
  * @param pool Thread pool to get thread count of.
  * @retval Thread count.
  */
@@ -68,11 +205,51 @@ thread_pool_thread_count(const struct thread_pool *pool);
  * @param pool Pool to delete.
  * @retval 0 Success.
  * @retval != Error code.
- *     - TPOOL_ERR_HAS_TASKS - pool still has tasks.
+ *     - TPOOL_ERR_HAS_TASKS - pool still has tasks, or tasks
+ *       created by thread_pool_task_new() are not deleted yet,
+ *       or the completion queue is not reaped.
  */
 int
 thread_pool_delete(struct thread_pool *pool);
 
+/**
+ * Wait until @a pool has no tasks: the queues are empty and no
+ * worker runs a task. The waiter sleeps until the last task is
+ * finished, which wakes it up once. Delayed tasks keep the pool
+ * busy until they are run, periodic ones until they are cancelled.
+ * The finished tasks still have to be joined or reaped as usual.
+ * @param pool Thread pool to wait for.
+ * @param timeout Timeout in seconds. 0 means no waiting at all.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - called from a task of
+ *       @a pool, which would wait for itself.
+ *     - TPOOL_ERR_TIMEOUT - the pool still has tasks.
+ */
+int
+thread_pool_wait_idle(struct thread_pool *pool, double timeout);
+
+/**
+ * Wait until @a pool has no tasks, like thread_pool_wait_idle(),
+ * and then delete it.
+ * @param pool Pool to delete.
+ * @param timeout Timeout in seconds. 0 means no waiting at all.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - called from a task of
+ *       @a pool.
+ *     - TPOOL_ERR_TIMEOUT - the pool still has tasks, it is not
+ *       deleted.
+ *     - TPOOL_ERR_HAS_TASKS - tasks created by
+ *       thread_pool_task_new() are not deleted yet, or the
+ *       completion queue is not reaped, or new tasks were pushed
+ *       meanwhile.
+ */
+int
+thread_pool_delete_wait(struct thread_pool *pool, double timeout);
+
 /**
  * Push @a task into thread pool queue.
  * @param pool Pool to push into.
@@ -86,6 +263,180 @@ thread_pool_delete(struct thread_pool *pool);
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a count tasks into thread pool queue at once. The batch
+ * is either pushed entirely or not pushed at all.
+ * @param pool Pool to push into.
+ * @param tasks Array of tasks to push.
+ * @param count Number of tasks in @a tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - count is negative.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - the batch does not fit into
+ *       the pool's task limit.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count);
+
+/**
+ * Push @a task to be queued after a delay. The task is in the pool
+ * right away: it can be joined or cancelled, and the pool can not be
+ * deleted until it is finished. A single timer thread per pool queues
+ * the due tasks with the precision of a millisecond.
+ * @param pool Thread pool to push into.
+ * @param task Task to push.
+ * @param delay Delay in seconds.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - delay is negative or too big.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ */
+int
+thread_pool_push_task_after(struct thread_pool *pool, struct thread_task *task,
+			    double delay);
+
+/**
+ * Push @a task to be run every @a period seconds, the first time
+ * after one period. A run late for more than a period shifts the
+ * next ones instead of being caught up. The task stays in the pool
+ * until it is cancelled via thread_task_cancel(). Then it can be
+ * joined, which succeeds with the result of the last run, or NULL
+ * if the task was cancelled before its first run.
+ * @param pool Thread pool to push into.
+ * @param task Task to push.
+ * @param period Period in seconds, at least a millisecond.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - period is too small or too
+ *       big.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ */
+int
+thread_pool_push_task_every(struct thread_pool *pool, struct thread_task *task,
+			    double period);
+
+/**
+ * Push @a task, waiting for room in the pool if it has too many
+ * tasks already. The waiting producers get the freed places in
+ * the order they came.
+ * @param pool Thread pool to push into.
+ * @param task Task to push.
+ * @param timeout Timeout in seconds. 0 means no waiting.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TIMEOUT - no room appeared in time, the task is
+ *       not pushed.
+ */
+int
+thread_pool_push_task_wait(struct thread_pool *pool, struct thread_task *task,
+			   double timeout);
+
+enum {
+	/** Number of buckets in the time histograms of the stats. */
+	TPOOL_STATS_BUCKETS = 32,
+};
+
+/**
+ * Pool statistics. The counters are cumulative since the pool
+ * creation. Bucket i of a histogram counts the tasks which took
+ * from 2^i to 2^(i + 1) nanoseconds, the last one counts all the
+ * longer tasks too.
+ */
+struct thread_pool_stats {
+	/** Pushes accepted by the pool, one per periodic task. */
+	uint64_t tasks_pushed;
+	/** Runs of the tasks finished, each one of a periodic task. */
+	uint64_t tasks_completed;
+	/** Tasks finished by a cancel without running. */
+	uint64_t tasks_cancelled;
+	/** Tasks waiting for a worker right now. */
+	int queue_depth;
+	/** Most tasks ever waiting for a worker at once. */
+	int peak_queue_depth;
+	/** Worker threads started. */
+	uint64_t workers_created;
+	/** Worker threads exited after the idle timeout. */
+	uint64_t workers_retired;
+	/** How long the tasks waited in the queues. */
+	uint64_t wait_time_hist[TPOOL_STATS_BUCKETS];
+	/** How long the tasks ran. */
+	uint64_t run_time_hist[TPOOL_STATS_BUCKETS];
+};
+
+/**
+ * Take a snapshot of @a pool statistics. The workers keep their
+ * own counters, the other threads share one, and the snapshot
+ * just sums them up. It is not atomic, so the counters can be
+ * off by the tasks pushed and finishing meanwhile. A task is
+ * counted as pushed before it can finish.
+ * @param pool Thread pool to get the stats of.
+ * @param[out] stats Where to store the stats.
+ */
+void
+thread_pool_get_stats(const struct thread_pool *pool,
+		      struct thread_pool_stats *stats);
+
+/**
+ * Write the events recorded by @a pool into a file in the Chrome
+ * trace JSON format, viewable in chrome://tracing or Perfetto.
+ * Each worker is a thread of the trace, and one more thread
+ * shows the pushes from outside of the pool. The events are
+ * pushes, runs of the tasks, steals, and the periods of workers
+ * sleeping without work. A task suspended on its fiber ends its
+ * run there and starts another one when resumed. Can be called
+ * while the pool works.
+ * @param pool Thread pool to dump the trace of.
+ * @param path File to write.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the pool is not traced.
+ *     - TPOOL_ERR_IO - the file can't be written.
+ */
+int
+thread_pool_trace_dump(struct thread_pool *pool, const char *path);
+
+/**
+ * How many tasks of the given priority are pushed into @a pool
+ * and not yet taken by any worker.
+ * @param pool Thread pool to get the queue depth of.
+ * @param priority One of enum thread_task_priority.
+ * @retval Queue depth, 0 for an unknown priority.
+ */
+int
+thread_pool_queue_depth(const struct thread_pool *pool, int priority);
+
+/**
+ * Eventfd of the completion queue of @a pool, to be polled for
+ * reading. It should not be read directly, the reaps reset it.
+ * @param pool Thread pool to get the descriptor of.
+ * @retval Descriptor, -1 if the pool has no completion queue.
+ */
+int
+thread_pool_completion_fd(const struct thread_pool *pool);
+
+/**
+ * Take up to @a max finished tasks from the completion queue of
+ * @a pool, in the order they finished. The tasks have to be joined
+ * then as usual, which does not block. The eventfd stays readable
+ * if more tasks are left.
+ * @param pool Thread pool to reap the tasks of.
+ * @param[out] tasks Array to store the tasks to.
+ * @param max Size of @a tasks.
+ * @retval Number of the stored tasks, 0 if there are none or the
+ *         pool has no completion queue.
+ */
+int
+thread_pool_reap_completed(struct thread_pool *pool,
+			   struct thread_task **tasks, int max);
+
 /** Thread pool task API. */
 
 /**
@@ -99,6 +450,117 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg);
 
+/**
+ * Like thread_task_new() but take the task object from the cache
+ * of @a pool instead of the heap. Deleted and detached tasks go
+ * back to the cache, so after a warm up creating tasks does no
+ * allocations. All such tasks have to be deleted before the pool.
+ * @param pool Pool owning the task memory.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ * @param arg Argument for @a function.
+ *
+ * @retval Always 0.
+ */
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     thread_task_f function, void *arg);
+
+/**
+ * Like thread_task_new() but copy @a size bytes of the argument
+ * into the task object. The function gets a pointer to the copy,
+ * and can write its result there in place of the argument. Then no
+ * memory has to be allocated for the argument and the result.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ * @param arg Argument to copy.
+ * @param size Size of @a arg, at most TPOOL_TASK_INLINE_SIZE.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a size is too big.
+ */
+int
+thread_task_new_inline(struct thread_task **task, thread_task_f function,
+		       const void *arg, size_t size);
+
+/**
+ * Like thread_task_new_inline() but take the task object from the
+ * cache of @a pool, see thread_pool_task_new().
+ * @param pool Pool owning the task memory.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ * @param arg Argument to copy.
+ * @param size Size of @a arg, at most TPOOL_TASK_INLINE_SIZE.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a size is too big.
+ */
+int
+thread_pool_task_new_inline(struct thread_pool *pool,
+			    struct thread_task **task, thread_task_f function,
+			    const void *arg, size_t size);
+
+/**
+ * Inline storage of @a task, TPOOL_TASK_INLINE_SIZE bytes aligned
+ * for any type. It holds the argument of a task made by
+ * thread_task_new_inline(), or whatever the function wrote there,
+ * and can be read after the join. It can be written before the
+ * task is pushed again, to reuse it with a new argument.
+ * @param task Task to get the storage of.
+ * @retval Pointer to the storage.
+ */
+void *
+thread_task_inline_data(struct thread_task *task);
+
+/**
+ * How many times the task cache of @a pool had to allocate
+ * memory. Stays the same while the number of the pool's tasks
+ * alive at once does not grow.
+ * @param pool Pool to get the counter of.
+ * @retval Allocation count.
+ */
+uint64_t
+thread_pool_task_alloc_count(struct thread_pool *pool);
+
+/**
+ * Set priority of @a task. New tasks have TPOOL_PRIORITY_NORMAL.
+ * The priority is kept when the task is pushed again.
+ * @param task Task to change.
+ * @param priority One of enum thread_task_priority.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - unknown priority.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is pushed and not
+ *       joined yet.
+ */
+int
+thread_task_set_priority(struct thread_task *task, int priority);
+
+/**
+ * Make @a child wait for @a parent. When @a child is pushed, it
+ * is not queued until all the tasks it waits for are finished,
+ * and then it is queued into the pool it was pushed to. A task
+ * can wait for any number of others. Waiting for a task which
+ * is already finished is a no-op. Deleting a not pushed task
+ * releases the tasks waiting for it.
+ * The dependency is one-shot: it is satisfied once @a parent is
+ * finished and does not return when the tasks are pushed again.
+ * Cycles are not detected, the tasks in them are never run.
+ * @param parent Task to wait for.
+ * @param child Task to run after @a parent.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a parent and @a child are
+ *       the same task.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a child is pushed already.
+ */
+int
+thread_task_then(struct thread_task *parent, struct thread_task *child);
+
 /**
  * Check if @a task is finished and its result can be obtained.
  * @param task Task to check.
@@ -115,6 +577,9 @@ thread_task_is_running(const struct thread_task *task);
 
 /**
  * Join the task. If it is not finished, then wait until it is.
+ * While waiting, the calling thread runs the task itself if no
+ * worker has taken it yet, or other queued tasks of the pool. So a
+ * task can join its subtasks without deadlocking the pool.
  * Note, this function does not delete task object. It can be
  * reused for a next task or deleted via thread_task_delete.
  * @param task Task to join.
@@ -123,10 +588,43 @@ thread_task_is_running(const struct thread_task *task);
  * @retval 0 Success.
  * @retval != 0 Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ *     - TPOOL_ERR_TASK_CANCELLED - task was cancelled before it
+ *       started, the result is NULL. The task is joined anyway.
+ *       Never for a periodic task.
+ *     - TPOOL_ERR_TASK_IN_POOL - task belongs to a group, which
+ *       has not handed it out yet, or is not reaped from the
+ *       completion queue yet.
  */
 int
 thread_task_join(struct thread_task *task, void **result);
 
+/**
+ * Cancel a pushed task. If it is not started yet, it is taken
+ * out of its queue and never run. It still has to be joined, and
+ * the join reports the cancellation, but for a periodic task, see
+ * thread_pool_push_task_every(). The tasks waiting for it via
+ * thread_task_then() are released as if it finished.
+ * A running task is only asked to stop, see
+ * thread_task_is_cancel_requested().
+ * @param task Task to cancel.
+ *
+ * @retval 0 Success, the task will not run.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ *     - TPOOL_ERR_TASK_STARTED - task is running or finished
+ *       already.
+ */
+int
+thread_task_cancel(struct thread_task *task);
+
+/**
+ * Check if the task being run by the current thread is asked to
+ * stop by thread_task_cancel(). Long task functions can poll it and
+ * return early. Always false outside of task functions.
+ */
+bool
+thread_task_is_cancel_requested(void);
+
 #if NEED_TIMED_JOIN
 
 /**
@@ -153,7 +651,8 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result);
  * @retval 0 Success.
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_IN_POOL - can not drop the task. It still
- *       is in a pool. Need to join it firstly.
+ *       is in a pool. Need to join it firstly. Or it waits for
+ *       unfinished tasks to be run after them.
  */
 int
 thread_task_delete(struct thread_task *task);
@@ -169,8 +668,164 @@ thread_task_delete(struct thread_task *task);
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a
  *       pool.
+ *     - TPOOL_ERR_TASK_IN_POOL - task belongs to a group, or
+ *       goes to the completion queue.
 */
 int
 thread_task_detach(struct thread_task *task);
 
 #endif
+
+/** Task groups. */
+
+/**
+ * Create a group of tasks to wait for all together. A member
+ * belongs to the group from thread_task_group_add() until the group
+ * hands it out, and can not be joined or detached meanwhile.
+ * @param[out] group Pointer to a new group.
+ * @param is_auto_delete Delete the members when they finish, as
+ *   if they were detached. Otherwise finished members are handed
+ *   out by the waits and then joined as usual.
+ *
+ * @retval 0 Success.
+ */
+int
+thread_task_group_new(struct thread_task_group **group, bool is_auto_delete);
+
+/**
+ * Delete a group.
+ * @param group Group to delete.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_HAS_TASKS - there are unfinished members, or
+ *       finished ones which are not handed out yet.
+ */
+int
+thread_task_group_delete(struct thread_task_group *group);
+
+/**
+ * Add a task to a group. It has to be done before the task is
+ * pushed. A member deleted before being pushed leaves the group.
+ * @param group Group to add to.
+ * @param task Task to add.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - task is pushed already.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - task is in a group already.
+ */
+int
+thread_task_group_add(struct thread_task_group *group,
+		      struct thread_task *task);
+
+/**
+ * Wait until all the members are finished, and hand all of them
+ * out. There is one wakeup no matter how many members there are.
+ * @param group Group to wait for.
+ * @param timeout Timeout in seconds. 0 means no waiting at all.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TIMEOUT - some members are not finished yet,
+ *       nothing is handed out.
+ */
+int
+thread_task_group_wait_all(struct thread_task_group *group, double timeout);
+
+/**
+ * Wait until any member is finished and hand it out. Each finished
+ * member is handed out once.
+ * @param group Group to wait for.
+ * @param[out] task The finished member, now it can be joined.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the group has no members to
+ *       hand out, or it deletes them itself.
+ */
+int
+thread_task_group_wait_any(struct thread_task_group *group,
+			   struct thread_task **task);
+
+/** Parallel loops on top of the pool. */
+
+/**
+ * Body of a parallel loop.
+ * @param begin First index to process.
+ * @param end Index after the last one to process.
+ * @param ctx User context passed to the loop.
+ */
+typedef void (*thread_pool_for_f)(int64_t begin, int64_t end, void *ctx);
+
+/**
+ * Body of a parallel reduction. Accumulates indexes in
+ * [@a begin, @a end) into @a acc.
+ */
+typedef void (*thread_pool_reduce_f)(int64_t begin, int64_t end, void *acc,
+				     void *ctx);
+
+/**
+ * Combines two partial results of a reduction, stores the
+ * result into @a acc. Must be associative.
+ */
+typedef void (*thread_pool_combine_f)(void *acc, const void *other,
+				      void *ctx);
+
+/**
+ * Call @a fn for all indexes in [@a begin, @a end) split in
+ * pieces and spread across the workers of @a pool. The range is
+ * split recursively, so idle workers steal big pieces and the
+ * load is balanced even if the pieces take different time. The
+ * calling thread runs a piece too and returns when the whole
+ * range is done. Can be called from a task running in @a pool.
+ * @param pool Pool to run the loop in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Minimal number of indexes passed to one call of
+ *   @a fn. 0 picks it automatically. Can be made bigger so as
+ *   not to cut the range into too many pieces.
+ * @param fn Loop body.
+ * @param ctx Argument for @a fn.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a begin is greater than
+ *       @a end, or @a grain is negative.
+ *     - An error of thread_task_join() on a piece of the loop.
+ *       All the pieces are over by the return anyway.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, int64_t begin, int64_t end,
+			 int64_t grain, thread_pool_for_f fn, void *ctx);
+
+/**
+ * Like thread_pool_parallel_for() but also reduce the range to
+ * one value. Each piece of the range is accumulated by @a fn
+ * into its own copy of the initial @a result, then the partial
+ * results are merged into @a result with @a combine in the
+ * order of the indexes.
+ * @param pool Pool to run the reduction in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Same as for thread_pool_parallel_for().
+ * @param fn Accumulates a piece of the range.
+ * @param combine Merges two partial results.
+ * @param ctx Argument for @a fn and @a combine.
+ * @param[in,out] result On input the identity value of the
+ *   reduction, on output its result.
+ * @param result_size Size of @a result in bytes.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a begin is greater than
+ *       @a end, or @a grain is negative, or @a result_size is 0.
+ *     - An error of thread_task_join() on a piece of the loop.
+ *       All the pieces are over by the return anyway.
+ */
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, int64_t begin,
+			    int64_t end, int64_t grain,
+			    thread_pool_reduce_f fn,
+			    thread_pool_combine_f combine, void *ctx,
+			    void *result, size_t result_size);